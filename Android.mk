@@ -53,7 +53,10 @@ LOCAL_C_INCLUDES := \
 
 LOCAL_SRC_FILES := \
 	autolock.cpp \
+	bufferreaper.cpp \
 	drmresources.cpp \
+	drmcommitmerger.cpp \
+	drmcompositorworker.cpp \
 	drmconnector.cpp \
 	drmcrtc.cpp \
 	drmdisplaycomposition.cpp \
@@ -64,8 +67,11 @@ LOCAL_SRC_FILES := \
 	drmmode.cpp \
 	drmplane.cpp \
 	drmproperty.cpp \
+	drmpropertyset.cpp \
 	glworker.cpp \
 	hwcutils.cpp \
+	importworker.cpp \
+	planearbiter.cpp \
 	platform.cpp \
 	platformdrmgeneric.cpp \
 	separate_rects.cpp \
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#define LOG_TAG "hwc-buffer-reaper"
+
+#include "bufferreaper.h"
+#include "drmresources.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <xf86drmMode.h>
+
+#include <cutils/properties.h>
+#include <log/log.h>
+#include <system/thread_defs.h>
+#include <utils/Trace.h>
+
+namespace android {
+
+BufferReaper::BufferReaper()
+    : Worker("drm-buffer-reaper", ANDROID_PRIORITY_BACKGROUND) {
+}
+
+BufferReaper::~BufferReaper() {
+  Exit();
+  Flush();
+}
+
+int BufferReaper::Init(DrmResources *drm) {
+  drm_ = drm;
+
+  char max_pending_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.max_pending_releases", max_pending_prop, "64");
+  max_pending_ = strtoul(max_pending_prop, NULL, 10);
+
+  char async_release_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.async_release", async_release_prop, "1");
+  if (!atoi(async_release_prop) || !max_pending_)
+    return 0;
+
+  return InitWorker();
+}
+
+void BufferReaper::QueueRelease(hwc_drm_bo_t *bo) {
+  PendingRelease release;
+  release.fb_id = bo->fb_id;
+  memcpy(release.gem_handles, bo->gem_handles, sizeof(release.gem_handles));
+  bo->fb_id = 0;
+  memset(bo->gem_handles, 0, sizeof(bo->gem_handles));
+
+  if (!release.fb_id && !release.gem_handles[0] && !release.gem_handles[1] &&
+      !release.gem_handles[2] && !release.gem_handles[3])
+    return;
+
+  Lock();
+  if (!initialized() || queue_.size() >= max_pending_) {
+    ++inline_releases_;
+    Unlock();
+    Release(release);
+    return;
+  }
+
+  queue_.push(release);
+  ++queued_releases_;
+  if (queue_.size() > max_pending_seen_)
+    max_pending_seen_ = queue_.size();
+  Unlock();
+  Signal();
+}
+
+void BufferReaper::Release(const PendingRelease &release) {
+  ATRACE_CALL();
+  if (release.fb_id && drmModeRmFB(drm_->fd(), release.fb_id))
+    ALOGE("Failed to rm fb %d", release.fb_id);
+
+  int num_gem_handles =
+      sizeof(release.gem_handles) / sizeof(release.gem_handles[0]);
+  for (int i = 0; i < num_gem_handles; i++) {
+    if (!release.gem_handles[i])
+      continue;
+
+    // Handles are shared between planes of the same buffer
+    bool released = false;
+    for (int j = 0; j < i; j++)
+      released |= release.gem_handles[j] == release.gem_handles[i];
+    if (released)
+      continue;
+
+    int ret = drm_->ReleaseGemHandle(release.gem_handles[i]);
+    if (ret)
+      ALOGE("Failed to close gem handle %d %d", i, ret);
+  }
+}
+
+void BufferReaper::Flush() {
+  Lock();
+  while (!queue_.empty()) {
+    PendingRelease release = queue_.front();
+    queue_.pop();
+    Release(release);
+    ++completed_releases_;
+  }
+  Unlock();
+}
+
+void BufferReaper::Dump(std::ostringstream *out) {
+  Lock();
+  *out << "--BufferReaper: pending=" << queue_.size()
+       << " max_pending=" << max_pending_seen_ << "/" << max_pending_
+       << " queued=" << queued_releases_
+       << " completed=" << completed_releases_
+       << " inline=" << inline_releases_ << "\n";
+  Unlock();
+}
+
+void BufferReaper::Routine() {
+  Lock();
+  if (queue_.empty()) {
+    int ret = WaitForSignalOrExitLocked();
+    if (ret == -EINTR || queue_.empty()) {
+      Unlock();
+      return;
+    }
+  }
+
+  PendingRelease release = queue_.front();
+  queue_.pop();
+  Unlock();
+
+  Release(release);
+
+  Lock();
+  ++completed_releases_;
+  Unlock();
+}
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_BUFFER_REAPER_H_
+#define ANDROID_BUFFER_REAPER_H_
+
+#include "drmhwcgralloc.h"
+#include "worker.h"
+
+#include <stdint.h>
+
+#include <queue>
+#include <sstream>
+
+namespace android {
+
+class DrmResources;
+
+// Removes framebuffers and closes gem handles off the present path. RmFB of an
+// fb that's still being scanned out blocks until the next vblank on several
+// KMS drivers, so releases are queued to a low priority thread instead. Once
+// kMaxPendingReleases (hwc.drm.max_pending_releases) are queued, or when the
+// thread is disabled (hwc.drm.async_release=0), buffers are released inline.
+class BufferReaper : public Worker {
+ public:
+  BufferReaper();
+  ~BufferReaper() override;
+
+  int Init(DrmResources *drm);
+
+  // Takes over the fb_id and gem_handles of bo and clears them
+  void QueueRelease(hwc_drm_bo_t *bo);
+
+  // Releases everything still queued on the calling thread
+  void Flush();
+
+  void Dump(std::ostringstream *out);
+
+ protected:
+  void Routine() override;
+
+ private:
+  static const unsigned kMaxPendingReleases = 64;
+
+  struct PendingRelease {
+    uint32_t fb_id;
+    uint32_t gem_handles[4];
+  };
+
+  void Release(const PendingRelease &release);
+
+  DrmResources *drm_ = NULL;
+  unsigned max_pending_ = kMaxPendingReleases;
+  std::queue<PendingRelease> queue_;
+
+  // Stats, protected by the worker lock
+  uint64_t queued_releases_ = 0;
+  uint64_t inline_releases_ = 0;
+  uint64_t completed_releases_ = 0;
+  size_t max_pending_seen_ = 0;
+};
+}
+
+#endif
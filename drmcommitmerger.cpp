@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#define LOG_TAG "hwc-drm-commit-merger"
+
+#include "drmcommitmerger.h"
+#include "autolock.h"
+#include "drmresources.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <set>
+
+#include <cutils/properties.h>
+#include <drm/drm_mode.h>
+#include <log/log.h>
+#include <utils/Trace.h>
+
+namespace android {
+
+static int64_t MonotonicNs() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+  return (int64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+// A commit spanning several crtcs sends a flip event for each of them, all
+// with this as user data. Once every crtc of the merged requests flipped, the
+// flip events of the requests are handled.
+class DrmMergedFlipEvent : public DrmEventHandler {
+ public:
+  DrmMergedFlipEvent(std::vector<DrmEventHandler *> handlers,
+                     std::set<uint32_t> crtcs)
+      : handlers_(handlers), pending_crtcs_(crtcs) {
+  }
+
+  ~DrmMergedFlipEvent() override {
+    for (DrmEventHandler *handler : handlers_)
+      delete handler;
+  }
+
+  void HandleEvent(uint64_t /* timestamp_us */) override {
+    ALOGE("Merged flip event without a crtc");
+  }
+
+  void HandleFlipEvent(uint32_t crtc_id, uint64_t timestamp_us) override {
+    if (!pending_crtcs_.erase(crtc_id) || !pending_crtcs_.empty())
+      return;
+    for (DrmEventHandler *handler : handlers_)
+      handler->HandleEvent(timestamp_us);
+  }
+
+  bool complete() const override {
+    return pending_crtcs_.empty();
+  }
+
+  // Hands the handlers back, when the merged commit failed
+  void Release() {
+    handlers_.clear();
+  }
+
+ private:
+  std::vector<DrmEventHandler *> handlers_;
+  std::set<uint32_t> pending_crtcs_;
+};
+
+DrmCommitMerger::DrmCommitMerger() {
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&cond_, NULL);
+}
+
+DrmCommitMerger::~DrmCommitMerger() {
+  pthread_cond_destroy(&cond_);
+  pthread_mutex_destroy(&lock_);
+}
+
+int DrmCommitMerger::Init(DrmResources *drm) {
+  drm_ = drm;
+
+  char merge_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.merge_display_commits", merge_prop, "0");
+  enabled_ = atoi(merge_prop);
+
+  char window_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.merge_window_us", window_prop, "4000");
+  window_ns_ = strtoll(window_prop, NULL, 10) * 1000;
+  return 0;
+}
+
+void DrmCommitMerger::SetDisplayActive(int display, bool active) {
+  AutoLock lock(&lock_, "commit merger");
+  if (lock.Lock())
+    return;
+
+  displays_[display].active = active;
+  // Whoever waits for us may be able to go ahead now
+  pthread_cond_broadcast(&cond_);
+}
+
+void DrmCommitMerger::SetDisplayThreaded(int display, bool threaded) {
+  AutoLock lock(&lock_, "commit merger");
+  if (lock.Lock())
+    return;
+
+  DisplayState &state = displays_[display];
+  if (state.threaded == threaded)
+    return;
+  state.threaded = threaded;
+  if (threaded)
+    --inline_displays_;
+  else
+    ++inline_displays_;
+}
+
+bool DrmCommitMerger::BatchCompleteLocked(int64_t now_ns) const {
+  for (auto &d : displays_) {
+    if (!d.second.active || now_ns - d.second.last_commit_ns > kIdleNs)
+      continue;
+    bool queued = false;
+    for (const Request *request : batch_)
+      queued |= request->display == d.first;
+    if (!queued)
+      return false;
+  }
+  return true;
+}
+
+int DrmCommitMerger::Commit(int display, uint32_t crtc_id,
+                            drmModeAtomicReqPtr pset, uint32_t flags,
+                            void *user_data) {
+  uint32_t mergeable_flags =
+      DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+  if (!enabled_ || (flags & DRM_MODE_ATOMIC_TEST_ONLY) ||
+      (flags & mergeable_flags) != mergeable_flags)
+    return drmModeAtomicCommit(drm_->fd(), pset, flags, user_data);
+
+  pthread_mutex_lock(&lock_);
+  // Waiting for the other displays would only delay an inline display, and
+  // it would hold up the others until the window runs out
+  if (inline_displays_) {
+    pthread_mutex_unlock(&lock_);
+    return drmModeAtomicCommit(drm_->fd(), pset, flags, user_data);
+  }
+
+  ATRACE_CALL();
+  Request request;
+  request.display = display;
+  request.crtc_id = crtc_id;
+  request.pset = pset;
+  request.flags = flags;
+  request.user_data = user_data;
+
+  int64_t now_ns = MonotonicNs();
+  // A display we didn't know about counts as on until told otherwise
+  DisplayState &state = displays_[display];
+  bool was_idle = now_ns - state.last_commit_ns > kIdleNs;
+  state.last_commit_ns = now_ns;
+  batch_.push_back(&request);
+
+  if (batch_.size() > 1) {
+    // The first display of the batch commits for all of us
+    pthread_cond_broadcast(&cond_);
+    while (!request.done)
+      pthread_cond_wait(&cond_, &lock_);
+    pthread_mutex_unlock(&lock_);
+    return request.ret;
+  }
+
+  // Don't hold up a display that just woke up, the others have no reason to
+  // be in step with it yet
+  if (!was_idle) {
+    struct timespec timeout;
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_nsec += window_ns_ % (1000 * 1000 * 1000);
+    timeout.tv_sec += window_ns_ / (1000 * 1000 * 1000) +
+                      timeout.tv_nsec / (1000 * 1000 * 1000);
+    timeout.tv_nsec %= 1000 * 1000 * 1000;
+
+    int ret = 0;
+    while (!BatchCompleteLocked(MonotonicNs()) && ret != ETIMEDOUT)
+      ret = pthread_cond_timedwait(&cond_, &lock_, &timeout);
+    if (ret == ETIMEDOUT)
+      ++window_timeouts_;
+  }
+
+  std::vector<Request *> batch;
+  batch.swap(batch_);
+  pthread_mutex_unlock(&lock_);
+
+  CommitBatch(batch);
+
+  pthread_mutex_lock(&lock_);
+  if (batch.size() > 1) {
+    ++merged_commits_;
+    merged_requests_ += batch.size();
+  } else {
+    ++single_commits_;
+  }
+  for (Request *r : batch)
+    r->done = true;
+  pthread_cond_broadcast(&cond_);
+  pthread_mutex_unlock(&lock_);
+  return request.ret;
+}
+
+void DrmCommitMerger::CommitBatch(std::vector<Request *> &batch) {
+  Request *first = batch.front();
+  if (batch.size() == 1) {
+    first->ret = drmModeAtomicCommit(drm_->fd(), first->pset, first->flags,
+                                     first->user_data);
+    return;
+  }
+
+  int ret = -ENOMEM;
+  drmModeAtomicReqPtr merged = drmModeAtomicDuplicate(first->pset);
+  std::vector<DrmEventHandler *> handlers;
+  std::set<uint32_t> crtcs;
+  for (Request *r : batch) {
+    if (merged && r != first && drmModeAtomicMerge(merged, r->pset) < 0)
+      break;
+    handlers.push_back((DrmEventHandler *)r->user_data);
+    crtcs.insert(r->crtc_id);
+  }
+
+  if (merged && handlers.size() == batch.size()) {
+    DrmMergedFlipEvent *event = new DrmMergedFlipEvent(handlers, crtcs);
+    ret = drmModeAtomicCommit(drm_->fd(), merged, first->flags, event);
+    if (ret) {
+      event->Release();
+      delete event;
+    }
+  }
+  if (merged)
+    drmModeAtomicFree(merged);
+
+  if (!ret) {
+    for (Request *r : batch)
+      r->ret = 0;
+    return;
+  }
+
+  // One display's frame shouldn't take down the others'
+  ALOGW("Merged commit of %zu displays failed ret=%d, committing separately",
+        batch.size(), ret);
+  for (Request *r : batch)
+    r->ret = drmModeAtomicCommit(drm_->fd(), r->pset, r->flags, r->user_data);
+
+  AutoLock lock(&lock_, "commit merger");
+  if (!lock.Lock())
+    ++fallbacks_;
+}
+
+void DrmCommitMerger::Dump(std::ostringstream *out) const {
+  if (!enabled_)
+    return;
+
+  AutoLock lock(&lock_, "commit merger");
+  if (lock.Lock())
+    return;
+
+  *out << "--DrmCommitMerger: window_us=" << window_ns_ / 1000
+       << (inline_displays_ ? " disabled (inline displays)" : "")
+       << " merged=" << merged_commits_ << " (" << merged_requests_
+       << " displays) single=" << single_commits_
+       << " window_timeouts=" << window_timeouts_
+       << " fallbacks=" << fallbacks_ << "\n";
+}
+}
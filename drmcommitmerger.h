@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_COMMIT_MERGER_H_
+#define ANDROID_DRM_COMMIT_MERGER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+#include <map>
+#include <sstream>
+#include <vector>
+
+namespace android {
+
+class DrmResources;
+
+// Merges the nonblocking frame commits of several displays into a single
+// atomic commit (hwc.drm.merge_display_commits=1). The first display to
+// commit waits up to hwc.drm.merge_window_us for the other displays that are
+// on and have been presenting, then commits everyone's request at once, so
+// their flips land on the same vblank. Should the merged commit fail, each
+// request is committed on its own. Tests, modesets and blocking commits are
+// never merged, and nothing is while any display commits inline, from the
+// thread that presents the other displays as well.
+class DrmCommitMerger {
+ public:
+  DrmCommitMerger();
+  ~DrmCommitMerger();
+
+  int Init(DrmResources *drm);
+
+  // Commits display's request, which is user_data's flip event handler if
+  // flags ask for one. The request must include display's crtc crtc_id, and
+  // no other crtc, so that it gets exactly one flip event.
+  int Commit(int display, uint32_t crtc_id, drmModeAtomicReqPtr pset,
+             uint32_t flags, void *user_data);
+
+  // Displays which are off aren't waited for
+  void SetDisplayActive(int display, bool active);
+
+  // Whether display commits from a compositor worker thread of its own
+  void SetDisplayThreaded(int display, bool threaded);
+
+  void Dump(std::ostringstream *out) const;
+
+ private:
+  static const int64_t kDefaultWindowNs = 4000000;
+  // Displays that haven't committed for this long are idle, and not waited for
+  static const int64_t kIdleNs = 40000000;
+
+  struct Request {
+    int display;
+    uint32_t crtc_id;
+    drmModeAtomicReqPtr pset;
+    uint32_t flags;
+    void *user_data;
+    int ret = 0;
+    bool done = false;
+  };
+
+  struct DisplayState {
+    bool active = true;
+    bool threaded = true;
+    int64_t last_commit_ns = 0;
+  };
+
+  bool BatchCompleteLocked(int64_t now_ns) const;
+  void CommitBatch(std::vector<Request *> &batch);
+
+  DrmResources *drm_ = NULL;
+  bool enabled_ = false;
+  int64_t window_ns_ = kDefaultWindowNs;
+
+  std::vector<Request *> batch_;
+  std::map<int, DisplayState> displays_;
+  size_t inline_displays_ = 0;
+
+  uint64_t merged_commits_ = 0;
+  uint64_t merged_requests_ = 0;
+  uint64_t single_commits_ = 0;
+  uint64_t window_timeouts_ = 0;
+  uint64_t fallbacks_ = 0;
+
+  mutable pthread_mutex_t lock_;
+  pthread_cond_t cond_;
+};
+}
+
+#endif  // ANDROID_DRM_COMMIT_MERGER_H_
@@ -14,65 +14,218 @@
  * limitations under the License.
  */
 
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
 #define LOG_TAG "hwc-drm-compositor-worker"
 
-#include "drmdisplaycompositor.h"
 #include "drmcompositorworker.h"
-#include "worker.h"
+#include "drmdisplaycompositor.h"
+#include "drmplane.h"
+#include "planearbiter.h"
 
 #include <stdlib.h>
 
-#include <log/log.h>
+#include <cutils/properties.h>
 #include <hardware/hardware.h>
+#include <log/log.h>
+#include <utils/Trace.h>
 
 namespace android {
 
-static const int64_t kSquashWait = 500000000LL;
-
-DrmCompositorWorker::DrmCompositorWorker(DrmDisplayCompositor *compositor)
-    : Worker("drm-compositor", HAL_PRIORITY_URGENT_DISPLAY),
-      compositor_(compositor) {
+DrmCompositorWorker::DrmCompositorWorker()
+    : Worker("drm-compositor", HAL_PRIORITY_URGENT_DISPLAY) {
 }
 
 DrmCompositorWorker::~DrmCompositorWorker() {
+  Exit();
+
+  // Whatever is left never makes it to the screen, destroying it releases the
+  // layers' buffers
+  Lock();
+  std::deque<std::unique_ptr<DrmDisplayComposition>> queue;
+  queue.swap(queue_);
+  Unlock();
 }
 
-int DrmCompositorWorker::Init() {
+int DrmCompositorWorker::Init(DrmDisplayCompositor *compositor,
+                              PlaneArbiter *plane_arbiter, int display) {
+  compositor_ = compositor;
+  plane_arbiter_ = plane_arbiter;
+  display_ = display;
+
+  char max_depth_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.composition_queue_depth", max_depth_prop, "2");
+  max_depth_ = strtoul(max_depth_prop, NULL, 10);
+
+  char drop_frames_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.composition_queue_drop", drop_frames_prop, "0");
+  drop_frames_ = atoi(drop_frames_prop);
+
+  char async_composition_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.async_composition", async_composition_prop, "1");
+  if (!atoi(async_composition_prop) || !max_depth_)
+    return 0;
+
   return InitWorker();
 }
 
-void DrmCompositorWorker::Routine() {
-  int ret;
-  if (!compositor_->HaveQueuedComposites()) {
-    Lock();
+int DrmCompositorWorker::Apply(
+    std::unique_ptr<DrmDisplayComposition> composition) {
+  ATRACE_CALL();
+  bool frame = composition->type() == DRM_COMPOSITION_TYPE_FRAME;
+  uint64_t frame_no = composition->frame_no();
 
-    // Only use a timeout if we didn't do a SquashAll last time. This will
-    // prevent wait_ret == -ETIMEDOUT which would trigger a SquashAll and be a
-    // pointless drain on resources.
-    int wait_ret = did_squash_all_ ? WaitForSignalOrExitLocked()
-                                   : WaitForSignalOrExitLocked(kSquashWait);
-    Unlock();
+  int ret = compositor_->ApplyComposition(std::move(composition));
+  if (ret) {
+    ALOGE("Failed to apply composition for display %d ret=%d", display_, ret);
+    return ret;
+  }
+
+  if (frame && plane_arbiter_)
+    plane_arbiter_->FrameCommitted(display_, frame_no);
+  return 0;
+}
+
+int DrmCompositorWorker::QueueComposition(
+    std::unique_ptr<DrmDisplayComposition> composition) {
+  ATRACE_CALL();
+  if (!initialized())
+    return Apply(std::move(composition));
 
-    switch (wait_ret) {
-      case 0:
-        break;
-      case -EINTR:
-        return;
-      case -ETIMEDOUT:
-        ret = compositor_->SquashAll();
-        if (ret)
-          ALOGE("Failed to squash all %d", ret);
-        did_squash_all_ = true;
-        return;
-      default:
-        ALOGE("Failed to wait for signal, %d", wait_ret);
-        return;
+  std::unique_ptr<DrmDisplayComposition> dropped;
+  std::unique_lock<std::mutex> lk(mutex_);
+  if (queue_.size() >= max_depth_) {
+    if (drop_frames_) {
+      dropped = std::move(queue_.front());
+      queue_.pop_front();
+      ++dropped_frames_;
+    } else {
+      ATRACE_NAME("WaitForQueue");
+      ++blocked_frames_;
+      done_cond_.wait(lk, [this]() { return queue_.size() < max_depth_; });
     }
   }
 
-  ret = compositor_->Composite();
-  if (ret)
-    ALOGE("Failed to composite! %d", ret);
-  did_squash_all_ = false;
+  queue_.push_back(std::move(composition));
+  ++queued_frames_;
+  if (queue_.size() > max_depth_seen_)
+    max_depth_seen_ = queue_.size();
+  lk.unlock();
+  Signal();
+
+  // Signals the release fences of the dropped frame, whose predecessor stays
+  // on the screen until a later frame replaces it
+  dropped.reset();
+  return 0;
+}
+
+int DrmCompositorWorker::ApplyComposition(
+    std::unique_ptr<DrmDisplayComposition> composition) {
+  Flush();
+  return Apply(std::move(composition));
+}
+
+void DrmCompositorWorker::Flush() {
+  if (!initialized())
+    return;
+
+  ATRACE_CALL();
+  std::unique_lock<std::mutex> lk(mutex_);
+  done_cond_.wait(lk, [this]() { return queue_.empty() && !applying_; });
+}
+
+// Moves the layers on cursor planes of composition to x/y if move is set.
+// Returns whether there are any.
+static bool MoveCursorLayers(DrmDisplayComposition *composition, bool move,
+                             int32_t x, int32_t y) {
+  if (composition->type() != DRM_COMPOSITION_TYPE_FRAME)
+    return false;
+
+  bool found = false;
+  std::vector<DrmHwcLayer> &layers = composition->layers();
+  for (DrmCompositionPlane &comp_plane : composition->composition_planes()) {
+    if (comp_plane.type() != DrmCompositionPlane::Type::kLayer ||
+        comp_plane.plane()->type() != DRM_PLANE_TYPE_CURSOR ||
+        comp_plane.source_layers().empty())
+      continue;
+
+    found = true;
+    if (!move)
+      continue;
+    DrmHwcRect<int> &frame = layers[comp_plane.source_layers().front()]
+                                 .display_frame;
+    frame = DrmHwcRect<int>(x, y, x + frame.width(), y + frame.height());
+  }
+  return found;
+}
+
+int DrmCompositorWorker::MoveCursor(int32_t x, int32_t y) {
+  if (!initialized())
+    return compositor_->MoveCursor(x, y);
+
+  ATRACE_CALL();
+  std::unique_lock<std::mutex> lk(mutex_);
+  // Nothing can get in between, move it right away. The thread doesn't take
+  // the worker lock while the compositor's is held, so holding it is safe.
+  if (queue_.empty() && !applying_)
+    return compositor_->MoveCursor(x, y);
+
+  if (queue_.empty()) {
+    // The frame being applied was planned with the old position
+    cursor_pending_ = true;
+    cursor_x_ = x;
+    cursor_y_ = y;
+    return applying_cursor_ ? 0 : -ENOENT;
+  }
+
+  bool found = false;
+  for (std::unique_ptr<DrmDisplayComposition> &composition : queue_)
+    found = MoveCursorLayers(composition.get(), true, x, y);
+  return found ? 0 : -ENOENT;
+}
+
+void DrmCompositorWorker::Dump(std::ostringstream *out) {
+  Lock();
+  *out << "--CompositorWorker: display=" << display_
+       << (initialized() ? "" : " inline") << " pending=" << queue_.size()
+       << " max_pending=" << max_depth_seen_ << "/" << max_depth_
+       << (drop_frames_ ? " drop" : " block") << " queued=" << queued_frames_
+       << " applied=" << applied_frames_ << " dropped=" << dropped_frames_
+       << " blocked=" << blocked_frames_ << "\n";
+  Unlock();
+}
+
+void DrmCompositorWorker::Routine() {
+  Lock();
+  if (queue_.empty()) {
+    int ret = WaitForSignalOrExitLocked();
+    if (ret == -EINTR || queue_.empty()) {
+      Unlock();
+      return;
+    }
+  }
+
+  std::unique_ptr<DrmDisplayComposition> composition =
+      std::move(queue_.front());
+  queue_.pop_front();
+  applying_ = true;
+  applying_cursor_ = MoveCursorLayers(composition.get(), false, 0, 0);
+  Unlock();
+  done_cond_.notify_all();
+
+  Apply(std::move(composition));
+
+  Lock();
+  // Cursor moves that came in while the frame was applied go on top of it
+  while (cursor_pending_) {
+    cursor_pending_ = false;
+    int32_t x = cursor_x_, y = cursor_y_;
+    Unlock();
+    compositor_->MoveCursor(x, y);
+    Lock();
+  }
+  applying_ = false;
+  ++applied_frames_;
+  Unlock();
+  done_cond_.notify_all();
 }
 }
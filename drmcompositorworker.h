@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_COMPOSITOR_WORKER_H_
+#define ANDROID_DRM_COMPOSITOR_WORKER_H_
+
+#include "drmdisplaycomposition.h"
+#include "worker.h"
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <sstream>
+
+namespace android {
+
+class DrmDisplayCompositor;
+class PlaneArbiter;
+
+// Applies a display's frame compositions on an urgent display priority
+// thread, so that PresentDisplay only has to plan the frame and hand out its
+// fences. Up to kMaxQueueDepth (hwc.drm.composition_queue_depth) frames wait
+// in the queue. Once it's full, PresentDisplay blocks until the oldest frame
+// has been picked up, or with hwc.drm.composition_queue_drop=1 the oldest
+// frame is dropped and its buffers are released right away. When the thread
+// is disabled (hwc.drm.async_composition=0) frames are applied inline.
+class DrmCompositorWorker : public Worker {
+ public:
+  DrmCompositorWorker();
+  ~DrmCompositorWorker() override;
+
+  int Init(DrmDisplayCompositor *compositor, PlaneArbiter *plane_arbiter,
+           int display);
+
+  // Queues a frame composition. Only errors of frames applied inline are
+  // returned, the thread logs its own.
+  int QueueComposition(std::unique_ptr<DrmDisplayComposition> composition);
+
+  // Applies any other composition, such as dpms or modesets, on the calling
+  // thread once all queued frames are done
+  int ApplyComposition(std::unique_ptr<DrmDisplayComposition> composition);
+
+  // Waits for all queued frames to be applied
+  void Flush();
+
+  // Moves the cursor plane to x/y. Queued frames are moved along, so they
+  // don't put the cursor back once they're applied. Returns -ENOENT if the
+  // latest frame has no cursor plane.
+  int MoveCursor(int32_t x, int32_t y);
+
+  void Dump(std::ostringstream *out);
+
+ protected:
+  void Routine() override;
+
+ private:
+  static const unsigned kMaxQueueDepth = 2;
+
+  int Apply(std::unique_ptr<DrmDisplayComposition> composition);
+
+  DrmDisplayCompositor *compositor_ = NULL;
+  PlaneArbiter *plane_arbiter_ = NULL;
+  int display_ = -1;
+
+  unsigned max_depth_ = kMaxQueueDepth;
+  bool drop_frames_ = false;
+  std::deque<std::unique_ptr<DrmDisplayComposition>> queue_;
+  bool applying_ = false;
+  bool applying_cursor_ = false;
+  // A cursor move for after the frame being applied
+  bool cursor_pending_ = false;
+  int32_t cursor_x_ = 0;
+  int32_t cursor_y_ = 0;
+  // Signaled whenever a frame leaves the queue or has been applied
+  std::condition_variable done_cond_;
+
+  // Stats, protected by the worker lock
+  uint64_t queued_frames_ = 0;
+  uint64_t applied_frames_ = 0;
+  uint64_t dropped_frames_ = 0;
+  uint64_t blocked_frames_ = 0;
+  size_t max_depth_seen_ = 0;
+};
+}
+
+#endif
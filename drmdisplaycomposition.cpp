@@ -122,6 +122,11 @@ int DrmDisplayComposition::AddPlaneDisable(DrmPlane *plane) {
   return 0;
 }
 
+int DrmDisplayComposition::AddPlaneRelease(DrmPlane *plane) {
+  released_planes_.push_back(plane);
+  return AddPlaneDisable(plane);
+}
+
 static std::vector<size_t> SetBitsToVector(
     uint64_t in, const std::vector<size_t> &index_map) {
   std::vector<size_t> out;
@@ -140,24 +145,27 @@ int DrmDisplayComposition::AddPlaneComposition(DrmCompositionPlane plane) {
 
 void DrmDisplayComposition::SeparateLayers(DrmHwcRect<int> *exclude_rects,
                                            size_t num_exclude_rects) {
-  DrmCompositionPlane *comp = NULL;
   std::vector<size_t> dedicated_layers;
 
-  // Go through the composition and find the precomp layer as well as any
-  // layers that have a dedicated plane located below the precomp layer.
+  // Go through the composition and find the precomp planes as well as the
+  // layers that have a dedicated plane located below each of them. With zpos,
+  // dedicated layers stacked above a precomp plane come after it and need no
+  // hole punched for them.
   for (auto &i : composition_planes_) {
     if (i.type() == DrmCompositionPlane::Type::kLayer) {
       dedicated_layers.insert(dedicated_layers.end(), i.source_layers().begin(),
                               i.source_layers().end());
     } else if (i.type() == DrmCompositionPlane::Type::kPrecomp) {
-      comp = &i;
-      break;
+      SeparatePrecompLayers(i.source_layers(), dedicated_layers, exclude_rects,
+                            num_exclude_rects);
     }
   }
-  if (!comp)
-    return;
+}
 
-  const std::vector<size_t> &comp_layers = comp->source_layers();
+void DrmDisplayComposition::SeparatePrecompLayers(
+    const std::vector<size_t> &comp_layers,
+    const std::vector<size_t> &dedicated_layers, DrmHwcRect<int> *exclude_rects,
+    size_t num_exclude_rects) {
   if (comp_layers.size() > 64) {
     ALOGE("Failed to separate layers because there are more than 64");
     return;
@@ -225,6 +233,40 @@ void DrmDisplayComposition::SeparateLayers(DrmHwcRect<int> *exclude_rects,
   }
 }
 
+// Finds the layers which aren't visible anywhere because opaque layers above
+// cover them entirely
+void DrmDisplayComposition::CullOccludedLayers() {
+  culled_layers_.assign(layers_.size(), false);
+  if (layers_.size() < 2 || layers_.size() > 64)
+    return;
+
+  std::vector<DrmHwcRect<int>> layer_rects(layers_.size());
+  std::transform(layers_.begin(), layers_.end(), layer_rects.begin(),
+                 [](const DrmHwcLayer &layer) { return layer.display_frame; });
+  std::vector<separate_rects::RectSet<uint64_t, int>> separate_regions;
+  separate_rects::separate_rects_64(layer_rects, &separate_regions);
+
+  // Every layer is visible down to the topmost opaque layer of each region it
+  // covers. Cursor layers move without a new composition, so they never count
+  // as opaque.
+  std::vector<bool> visible(layers_.size(), false);
+  for (separate_rects::RectSet<uint64_t, int> &region : separate_regions) {
+    uint64_t ids = region.id_set.getBits();
+    for (size_t i = layers_.size(); i-- > 0;) {
+      if (!(ids & ((uint64_t)1 << i)))
+        continue;
+      visible[i] = true;
+      const DrmHwcLayer &layer = layers_[i];
+      if (layer.blending == DrmHwcBlending::kNone && layer.alpha == 0xff &&
+          !layer.cursor)
+        break;
+    }
+  }
+
+  for (size_t i = 0; i < layers_.size(); ++i)
+    culled_layers_[i] = !visible[i];
+}
+
 int DrmDisplayComposition::CreateAndAssignReleaseFences() {
   std::unordered_set<DrmHwcLayer *> squash_layers;
   std::unordered_set<DrmHwcLayer *> pre_comp_layers;
@@ -275,6 +317,18 @@ int DrmDisplayComposition::CreateAndAssignReleaseFences() {
   }
   timeline_pre_comp_done_ = timeline_;
 
+  for (size_t i = 0; i < culled_layers_.size(); ++i) {
+    DrmHwcLayer *layer = &layers_[i];
+    if (!culled_layers_[i] || !layer->release_fence)
+      continue;
+    int ret = layer->release_fence.Set(CreateNextTimelineFence());
+    if (ret < 0) {
+      ALOGE("Failed to set the release fence (culled) %d", ret);
+      return ret;
+    }
+  }
+  timeline_culled_done_ = timeline_;
+
   for (DrmHwcLayer *layer : comp_layers) {
     if (!layer->release_fence)
       continue;
@@ -354,13 +408,40 @@ int DrmDisplayComposition::Plan(SquashState *squash,
         }
       }
     }
+  }
 
-    for (size_t i = 0; i < layers_.size(); ++i) {
-      if (layer_squash_area[i] < layers_[i].display_frame.area())
-        to_composite.emplace(std::make_pair(i, &layers_[i]));
+  // Hidden layers neither get planes nor are rendered by GL
+  CullOccludedLayers();
+  for (DrmCompositionRegion &region : squash_regions_) {
+    std::vector<size_t> &source_layers = region.source_layers;
+    source_layers.erase(
+        std::remove_if(source_layers.begin(), source_layers.end(),
+                       [this](size_t i) { return culled_layers_[i]; }),
+        source_layers.end());
+  }
+
+  // Squashing depends on more than the current layer stack, so only plans
+  // without it are cached
+  Planner::CachedPlan *cached_plan = planner_->cached_plan();
+  bool use_plan_cache = !use_squash_framebuffer && exclude_rects.empty();
+  std::vector<uint64_t> fingerprint;
+  if (use_plan_cache) {
+    fingerprint = GetPlanFingerprint(*primary_planes, *overlay_planes);
+    if (fingerprint == cached_plan->fingerprint) {
+      composition_planes_ = cached_plan->composition_planes;
+      pre_comp_regions_ = cached_plan->pre_comp_regions;
+      exclude_rects_.clear();
+      RemoveUsedPlanes(primary_planes, overlay_planes);
+      return CreateAndAssignReleaseFences();
     }
-  } else {
-    for (size_t i = 0; i < layers_.size(); ++i)
+  }
+  cached_plan->fingerprint.clear();
+
+  for (size_t i = 0; i < layers_.size(); ++i) {
+    if (culled_layers_[i])
+      continue;
+    if (squash == NULL ||
+        layer_squash_area[i] < layers_[i].display_frame.area())
       to_composite.emplace(std::make_pair(i, &layers_[i]));
   }
 
@@ -374,15 +455,66 @@ int DrmDisplayComposition::Plan(SquashState *squash,
     return ret;
   }
 
-  // Remove the planes we used from the pool before returning. This ensures they
-  // won't be reused by another display in the composition.
+  // make sure that source layers are ordered based on zorder
+  for (auto &i : composition_planes_)
+    std::sort(i.source_layers().begin(), i.source_layers().end());
+
+  RemoveUsedPlanes(primary_planes, overlay_planes);
+
+  exclude_rects_ = exclude_rects;
+  SeparateLayers(exclude_rects_.data(), exclude_rects_.size());
+
+  if (use_plan_cache) {
+    cached_plan->fingerprint = std::move(fingerprint);
+    cached_plan->composition_planes = composition_planes_;
+    cached_plan->pre_comp_regions = pre_comp_regions_;
+  }
+
+  return CreateAndAssignReleaseFences();
+}
+
+// Everything the planner and SeparateLayers look at, so that frames with the
+// same fingerprint end up with the same plan
+std::vector<uint64_t> DrmDisplayComposition::GetPlanFingerprint(
+    const std::vector<DrmPlane *> &primary_planes,
+    const std::vector<DrmPlane *> &overlay_planes) const {
+  std::vector<uint64_t> fingerprint;
+  fingerprint.push_back(crtc_->id());
+  fingerprint.push_back(primary_planes.size());
+  for (DrmPlane *plane : primary_planes)
+    fingerprint.push_back(plane->id());
+  fingerprint.push_back(overlay_planes.size());
+  for (DrmPlane *plane : overlay_planes)
+    fingerprint.push_back(plane->id());
+
+  fingerprint.push_back(layers_.size());
+  for (const DrmHwcLayer &layer : layers_) {
+    for (int i = 0; i < 4; i++) {
+      fingerprint.push_back(layer.display_frame.bounds[i]);
+      // Source crops are in 16.16 fixed point once they get to the kernel
+      fingerprint.push_back((int64_t)(layer.source_crop.bounds[i] * 65536));
+    }
+    fingerprint.push_back(layer.transform);
+    fingerprint.push_back((uint64_t)layer.blending);
+    fingerprint.push_back(layer.alpha);
+    fingerprint.push_back(layer.buffer ? layer.buffer->format : 0);
+    fingerprint.push_back(layer.buffer ? layer.buffer->modifiers[0] : 0);
+    fingerprint.push_back(layer.protected_usage());
+    fingerprint.push_back(layer.cursor);
+    fingerprint.push_back(layer.solid_color);
+  }
+  return fingerprint;
+}
+
+// Removes the planes we used from the pool. This ensures they won't be reused
+// by another display in the composition.
+void DrmDisplayComposition::RemoveUsedPlanes(
+    std::vector<DrmPlane *> *primary_planes,
+    std::vector<DrmPlane *> *overlay_planes) {
   for (auto &i : composition_planes_) {
     if (!i.plane())
       continue;
 
-    // make sure that source layers are ordered based on zorder
-    std::sort(i.source_layers().begin(), i.source_layers().end());
-
     std::vector<DrmPlane *> *container;
     if (i.plane()->type() == DRM_PLANE_TYPE_PRIMARY)
       container = primary_planes;
@@ -395,8 +527,6 @@ int DrmDisplayComposition::Plan(SquashState *squash,
       }
     }
   }
-
-  return FinalizeComposition(exclude_rects.data(), exclude_rects.size());
 }
 
 int DrmDisplayComposition::FinalizeComposition() {
@@ -405,10 +535,62 @@ int DrmDisplayComposition::FinalizeComposition() {
 
 int DrmDisplayComposition::FinalizeComposition(DrmHwcRect<int> *exclude_rects,
                                                size_t num_exclude_rects) {
+  exclude_rects_.assign(exclude_rects, exclude_rects + num_exclude_rects);
   SeparateLayers(exclude_rects, num_exclude_rects);
   return CreateAndAssignReleaseFences();
 }
 
+int DrmDisplayComposition::DemoteTopLayer() {
+  auto top = composition_planes_.end();
+  for (auto i = composition_planes_.begin(); i != composition_planes_.end();
+       ++i) {
+    if (i->type() != DrmCompositionPlane::Type::kLayer ||
+        i->source_layers().empty())
+      continue;
+    if (top == composition_planes_.end() ||
+        i->source_layers().front() > top->source_layers().front())
+      top = i;
+  }
+  if (top == composition_planes_.end())
+    return -ENOENT;
+
+  // Protected layers can't be precomposited, and neither can anything below
+  // them since the precomp plane is on top
+  size_t layer_index = top->source_layers().front();
+  if (layers_[layer_index].protected_usage())
+    return -ENOENT;
+
+  // Everything in the precomp planes above the layer is above it in the stack
+  // as well, so it goes at the bottom of the lowest of them. Only with zpos
+  // may the layer end up above all precomp planes, which are then restacked.
+  auto precomp = std::find_if(top, composition_planes_.end(),
+                              [](const DrmCompositionPlane &p) {
+    return p.type() == DrmCompositionPlane::Type::kPrecomp;
+  });
+  if (precomp == composition_planes_.end()) {
+    for (auto i = composition_planes_.begin(); i != top; ++i)
+      if (i->type() == DrmCompositionPlane::Type::kPrecomp)
+        precomp = i;
+  }
+  if (precomp != composition_planes_.end()) {
+    precomp->source_layers().push_back(layer_index);
+    std::sort(precomp->source_layers().begin(),
+              precomp->source_layers().end());
+    *top = DrmCompositionPlane(DrmCompositionPlane::Type::kDisable,
+                               top->plane(), top->crtc());
+  } else {
+    *top = DrmCompositionPlane(DrmCompositionPlane::Type::kPrecomp,
+                               top->plane(), top->crtc(), layer_index);
+  }
+
+  // The demoted layer is released with the rest of the composition, which is
+  // later than it would be as a precomp layer, but never too early.
+  Planner::AssignZpos(&composition_planes_);
+  pre_comp_regions_.clear();
+  SeparateLayers(exclude_rects_.data(), exclude_rects_.size());
+  return 0;
+}
+
 static const char *DrmCompositionTypeToString(DrmCompositionType type) {
   switch (type) {
     case DRM_COMPOSITION_TYPE_EMPTY:
@@ -540,8 +722,9 @@ void DrmDisplayComposition::Dump(std::ostringstream *out) const {
       break;
   }
 
-  *out << " timeline[current/squash/pre-comp/done]=" << timeline_current_ << "/"
-       << timeline_squash_done_ << "/" << timeline_pre_comp_done_ << "/"
+  *out << " timeline[current/squash/pre-comp/culled/done]="
+       << timeline_current_ << "/" << timeline_squash_done_ << "/"
+       << timeline_pre_comp_done_ << "/" << timeline_culled_done_ << "/"
        << timeline_ << "\n";
 
   *out << "    Layers: count=" << layers_.size() << "\n";
@@ -549,10 +732,17 @@ void DrmDisplayComposition::Dump(std::ostringstream *out) const {
     const DrmHwcLayer &layer = layers_[i];
     *out << "      [" << i << "] ";
 
-    DumpBuffer(layer.buffer, out);
+    if (layer.solid_color)
+      *out << "color[r/g/b/a]=" << (int)layer.color.r << "/"
+           << (int)layer.color.g << "/" << (int)layer.color.b << "/"
+           << (int)layer.color.a;
+    else
+      DumpBuffer(layer.buffer, out);
 
     if (layer.protected_usage())
       *out << " protected";
+    if (i < culled_layers_.size() && culled_layers_[i])
+      *out << " culled";
 
     *out << " transform=";
     DumpTransform(layer.transform, out);
@@ -589,6 +779,9 @@ void DrmDisplayComposition::Dump(std::ostringstream *out) const {
         break;
     }
 
+    if (comp_plane.zpos() >= 0)
+      *out << " zpos=" << comp_plane.zpos();
+
     *out << " source_layer=";
     for (auto i : comp_plane.source_layers()) {
       *out << i << " ";
@@ -22,6 +22,7 @@
 #include "drmplane.h"
 #include "glworker.h"
 
+#include <memory>
 #include <sstream>
 #include <vector>
 
@@ -29,6 +30,10 @@
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
 
+// Upper bound on the number of precomposition planes in a composition, each of
+// which is rendered into framebuffers of its own
+#define DRM_MAX_PRECOMP_PLANES 4
+
 namespace android {
 
 class Importer;
@@ -67,7 +72,9 @@ class DrmCompositionPlane {
   };
 
   DrmCompositionPlane() = default;
+  DrmCompositionPlane(const DrmCompositionPlane &rhs) = default;
   DrmCompositionPlane(DrmCompositionPlane &&rhs) = default;
+  DrmCompositionPlane &operator=(const DrmCompositionPlane &other) = default;
   DrmCompositionPlane &operator=(DrmCompositionPlane &&other) = default;
   DrmCompositionPlane(Type type, DrmPlane *plane, DrmCrtc *crtc)
       : type_(type), plane_(plane), crtc_(crtc) {
@@ -103,11 +110,20 @@ class DrmCompositionPlane {
     return source_layers_;
   }
 
+  // zpos to set on the plane, or -1 to leave it alone
+  int64_t zpos() const {
+    return zpos_;
+  }
+  void set_zpos(int64_t zpos) {
+    zpos_ = zpos;
+  }
+
  private:
   Type type_ = Type::kDisable;
   DrmPlane *plane_ = NULL;
   DrmCrtc *crtc_ = NULL;
   std::vector<size_t> source_layers_;
+  int64_t zpos_ = -1;
 };
 
 class DrmDisplayComposition {
@@ -122,6 +138,8 @@ class DrmDisplayComposition {
   int SetLayers(DrmHwcLayer *layers, size_t num_layers, bool geometry_changed);
   int AddPlaneComposition(DrmCompositionPlane plane);
   int AddPlaneDisable(DrmPlane *plane);
+  // Disables plane, which the display is giving back to the PlaneArbiter
+  int AddPlaneRelease(DrmPlane *plane);
   int SetDpmsMode(uint32_t dpms_mode);
   int SetDisplayMode(const DrmMode &display_mode);
 
@@ -130,6 +148,12 @@ class DrmDisplayComposition {
 
   int FinalizeComposition();
 
+  // Moves the topmost layer with a dedicated plane into the lowest precomp
+  // plane above it. If there's no precomposition yet, the layer's plane
+  // becomes the precomp plane, otherwise it's disabled. Returns -ENOENT if
+  // there's no layer left which can be precomposited.
+  int DemoteTopLayer();
+
   int CreateNextTimelineFence();
   int SignalSquashDone() {
     return IncreaseTimelineToPoint(timeline_squash_done_);
@@ -137,6 +161,11 @@ class DrmDisplayComposition {
   int SignalPreCompDone() {
     return IncreaseTimelineToPoint(timeline_pre_comp_done_);
   }
+  // Releases the layers hidden by opaque layers above them, which only the
+  // previous composition may have been scanning out
+  int SignalCulledDone() {
+    return IncreaseTimelineToPoint(timeline_culled_done_);
+  }
   int SignalCompositionDone() {
     return IncreaseTimelineToPoint(timeline_);
   }
@@ -197,6 +226,26 @@ class DrmDisplayComposition {
     out_fence_.Set(out_fence);
   }
 
+  const std::vector<DrmPlane *> &released_planes() const {
+    return released_planes_;
+  }
+
+  // Number of planes which kept scanning out the previous composition's
+  // buffer because this one's wasn't ready in time
+  size_t stale_layers() const {
+    return stale_layers_;
+  }
+
+  void set_stale_layers(size_t stale_layers) {
+    stale_layers_ = stale_layers;
+  }
+
+  // Keeps the composition whose buffers we latched alive, with its release
+  // fences unsignaled, until this one is replaced
+  void set_stale_source(std::unique_ptr<DrmDisplayComposition> source) {
+    stale_source_ = std::move(source);
+  }
+
   void Dump(std::ostringstream *out) const;
 
  private:
@@ -206,9 +255,20 @@ class DrmDisplayComposition {
 
   int FinalizeComposition(DrmHwcRect<int> *exclude_rects,
                           size_t num_exclude_rects);
+  void CullOccludedLayers();
   void SeparateLayers(DrmHwcRect<int> *exclude_rects, size_t num_exclude_rects);
+  void SeparatePrecompLayers(const std::vector<size_t> &comp_layers,
+                             const std::vector<size_t> &dedicated_layers,
+                             DrmHwcRect<int> *exclude_rects,
+                             size_t num_exclude_rects);
   int CreateAndAssignReleaseFences();
 
+  std::vector<uint64_t> GetPlanFingerprint(
+      const std::vector<DrmPlane *> &primary_planes,
+      const std::vector<DrmPlane *> &overlay_planes) const;
+  void RemoveUsedPlanes(std::vector<DrmPlane *> *primary_planes,
+                        std::vector<DrmPlane *> *overlay_planes);
+
   DrmResources *drm_ = NULL;
   DrmCrtc *crtc_ = NULL;
   Importer *importer_ = NULL;
@@ -223,6 +283,7 @@ class DrmDisplayComposition {
   int timeline_current_ = 0;
   int timeline_squash_done_ = 0;
   int timeline_pre_comp_done_ = 0;
+  int timeline_culled_done_ = 0;
   UniqueFd out_fence_ = -1;
 
   bool geometry_changed_;
@@ -230,8 +291,16 @@ class DrmDisplayComposition {
   std::vector<DrmCompositionRegion> squash_regions_;
   std::vector<DrmCompositionRegion> pre_comp_regions_;
   std::vector<DrmCompositionPlane> composition_planes_;
+  std::vector<DrmPlane *> released_planes_;
+  // Layers entirely covered by opaque layers above, which aren't planned
+  std::vector<bool> culled_layers_;
+  // Squashed regions excluded from the precomposition
+  std::vector<DrmHwcRect<int>> exclude_rects_;
 
   uint64_t frame_no_ = 0;
+
+  size_t stale_layers_ = 0;
+  std::unique_ptr<DrmDisplayComposition> stale_source_;
 };
 }
 
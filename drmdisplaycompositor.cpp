@@ -19,17 +19,23 @@
 
 #include "drmdisplaycompositor.h"
 
+#include <poll.h>
 #include <pthread.h>
 #include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <mutex>
 #include <sstream>
 #include <vector>
 
+#include <cutils/properties.h>
 #include <log/log.h>
+#include <drm/drm_fourcc.h>
 #include <drm/drm_mode.h>
 #include <sync/sync.h>
 #include <utils/Trace.h>
+#include <xf86drm.h>
 
 #include "autolock.h"
 #include "drmcrtc.h"
@@ -39,6 +45,34 @@
 
 namespace android {
 
+// What flip events reach their compositor through. The compositor unsets
+// itself when it's destroyed, since the kernel may still owe it the events of
+// flips WaitForFlip gave up on.
+struct DrmFlipTarget {
+  std::mutex mutex;
+  DrmDisplayCompositor *compositor = NULL;
+};
+
+// Handed to the kernel with each nonblocking commit, and deleted by
+// DrmEventListener::FlipHandler once the commit's flip event was handled
+class DrmFlipEvent : public DrmEventHandler {
+ public:
+  DrmFlipEvent(const std::shared_ptr<DrmFlipTarget> &target,
+               uint64_t flip_seq)
+      : target_(target), flip_seq_(flip_seq) {
+  }
+
+  void HandleEvent(uint64_t /* timestamp_us */) override {
+    std::lock_guard<std::mutex> lk(target_->mutex);
+    if (target_->compositor)
+      target_->compositor->FlipDone(flip_seq_);
+  }
+
+ private:
+  std::shared_ptr<DrmFlipTarget> target_;
+  uint64_t flip_seq_;
+};
+
 void SquashState::Init(DrmHwcLayer *layers, size_t num_layers) {
   generation_number_++;
   valid_history_ = 0;
@@ -194,6 +228,13 @@ DrmDisplayCompositor::~DrmDisplayCompositor() {
   if (!initialized_)
     return;
 
+  // Late flip events must not find us anymore
+  WaitForFlip();
+  {
+    std::lock_guard<std::mutex> lk(flip_target_->mutex);
+    flip_target_->compositor = NULL;
+  }
+
   int ret = pthread_mutex_lock(&lock_);
   if (ret)
     ALOGE("Failed to acquire compositor lock %d", ret);
@@ -210,6 +251,8 @@ DrmDisplayCompositor::~DrmDisplayCompositor() {
     ALOGE("Failed to acquire compositor lock %d", ret);
 
   pthread_mutex_destroy(&lock_);
+  pthread_cond_destroy(&flip_cond_);
+  pthread_mutex_destroy(&flip_lock_);
 }
 
 int DrmDisplayCompositor::Init(DrmResources *drm, int display) {
@@ -222,6 +265,22 @@ int DrmDisplayCompositor::Init(DrmResources *drm, int display) {
     return ret;
   }
 
+  ret = pthread_mutex_init(&flip_lock_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize flip lock %d\n", ret);
+    pthread_mutex_destroy(&lock_);
+    return ret;
+  }
+  ret = pthread_cond_init(&flip_cond_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize flip condition %d\n", ret);
+    pthread_mutex_destroy(&flip_lock_);
+    pthread_mutex_destroy(&lock_);
+    return ret;
+  }
+  flip_target_ = std::make_shared<DrmFlipTarget>();
+  flip_target_->compositor = this;
+
   pre_compositor_.reset(new GLWorkerCompositor());
   ret = pre_compositor_->Init();
   if (ret) {
@@ -229,10 +288,65 @@ int DrmDisplayCompositor::Init(DrmResources *drm, int display) {
     pre_compositor_.reset();
   }
 
+  // There's no generic way to ask gralloc for a given modifier, so the usage
+  // bits that make the vendor gralloc pick a tiled/compressed layout have to
+  // be provided by the board configuration.
+  char tiled_usage_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.tiled_framebuffer_usage", tiled_usage_prop, "0");
+  uint32_t tiled_usage = strtoul(tiled_usage_prop, NULL, 0);
+  if (tiled_usage && PlanesSupportTiledFramebuffers())
+    framebuffer_usage_ = tiled_usage;
+
+  char plan_search_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.plan_search", plan_search_prop, "1");
+  plan_search_ = atoi(plan_search_prop);
+
+  char nonblocking_commit_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.nonblocking_commit", nonblocking_commit_prop, "1");
+  nonblocking_commit_ = atoi(nonblocking_commit_prop);
+
+  // hwc.drm.latch_stale_buffers.<display> overrides the setting for all
+  // displays
+  char latch_stale_default[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.latch_stale_buffers", latch_stale_default, "1");
+  char latch_stale_key[PROPERTY_KEY_MAX];
+  snprintf(latch_stale_key, sizeof(latch_stale_key),
+           "hwc.drm.latch_stale_buffers.%d", display_);
+  char latch_stale_prop[PROPERTY_VALUE_MAX];
+  property_get(latch_stale_key, latch_stale_prop, latch_stale_default);
+  latch_stale_ = atoi(latch_stale_prop);
+
+  char latch_margin_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.latch_margin_us", latch_margin_prop, "2000");
+  latch_margin_ns_ = strtoll(latch_margin_prop, NULL, 10) * 1000;
+
   initialized_ = true;
   return 0;
 }
 
+bool DrmDisplayCompositor::PlanesSupportTiledFramebuffers() {
+  DrmCrtc *crtc = drm_->GetCrtcForDisplay(display_);
+  if (!crtc)
+    return false;
+
+  // The precomp and squash framebuffers can end up on any of our planes
+  bool found = false;
+  for (auto &plane : drm_->planes()) {
+    if (!plane->GetCrtcSupported(*crtc) ||
+        plane->type() == DRM_PLANE_TYPE_CURSOR)
+      continue;
+
+    std::vector<uint64_t> modifiers =
+        plane->GetFormatModifiers(DRM_FORMAT_ABGR8888);
+    if (std::find_if(modifiers.begin(), modifiers.end(), [](uint64_t m) {
+          return m != DRM_FORMAT_MOD_LINEAR;
+        }) == modifiers.end())
+      return false;
+    found = true;
+  }
+  return found;
+}
+
 std::unique_ptr<DrmDisplayComposition> DrmDisplayCompositor::CreateComposition()
     const {
   return std::unique_ptr<DrmDisplayComposition>(new DrmDisplayComposition());
@@ -251,8 +365,12 @@ DrmDisplayCompositor::GetActiveModeResolution() {
   return std::make_tuple(mode.h_display(), mode.v_display(), 0);
 }
 
+// Allocates fb to cover the whole display and adds a layer scanning out frame,
+// or all of it if frame is NULL, to display_comp. The framebuffer is never
+// sized to frame, so that it isn't reallocated whenever frame changes.
 int DrmDisplayCompositor::PrepareFramebuffer(
-    DrmFramebuffer &fb, DrmDisplayComposition *display_comp) {
+    DrmFramebuffer &fb, DrmDisplayComposition *display_comp,
+    const DrmHwcRect<int> *frame) {
   int ret = fb.WaitReleased(-1);
   if (ret) {
     ALOGE("Failed to wait for framebuffer release %d", ret);
@@ -268,8 +386,12 @@ int DrmDisplayCompositor::PrepareFramebuffer(
     return ret;
   }
 
+  DrmHwcRect<int> display_frame(0, 0, width, height);
+  if (frame)
+    display_frame = *frame;
+
   fb.set_release_fence_fd(-1);
-  if (!fb.Allocate(width, height)) {
+  if (!fb.Allocate(width, height, framebuffer_usage_)) {
     ALOGE("Failed to allocate framebuffer with size %dx%d", width, height);
     return -ENOMEM;
   }
@@ -278,14 +400,16 @@ int DrmDisplayCompositor::PrepareFramebuffer(
   DrmHwcLayer &pre_comp_layer = display_comp->layers().back();
   pre_comp_layer.sf_handle = fb.buffer()->handle;
   pre_comp_layer.blending = DrmHwcBlending::kPreMult;
-  pre_comp_layer.source_crop = DrmHwcRect<float>(0, 0, width, height);
-  pre_comp_layer.display_frame = DrmHwcRect<int>(0, 0, width, height);
-  ret = pre_comp_layer.buffer.ImportBuffer(fb.buffer()->handle,
-                                           display_comp->importer());
+  pre_comp_layer.source_crop =
+      DrmHwcRect<float>(display_frame.left, display_frame.top,
+                        display_frame.right, display_frame.bottom);
+  pre_comp_layer.display_frame = display_frame;
+  ret = fb.ImportBuffer(display_comp->importer());
   if (ret) {
     ALOGE("Failed to import framebuffer for display %d", ret);
     return ret;
   }
+  pre_comp_layer.buffer = fb.imported_buffer();
 
   return ret;
 }
@@ -293,6 +417,10 @@ int DrmDisplayCompositor::PrepareFramebuffer(
 int DrmDisplayCompositor::ApplySquash(DrmDisplayComposition *display_comp) {
   int ret = 0;
 
+  // There are only two squash framebuffers, the one we're about to render
+  // into may still be on the screen until the pending flip is done
+  WaitForFlip();
+
   DrmFramebuffer &fb = squash_framebuffers_[squash_framebuffer_index_];
   ret = PrepareFramebuffer(fb, display_comp);
   if (ret) {
@@ -325,73 +453,152 @@ int DrmDisplayCompositor::ApplySquash(DrmDisplayComposition *display_comp) {
   return 0;
 }
 
+// Returns the part of the display the precomp plane comp_plane scans out: the
+// bounding box of the pre_comp_regions of its layers, which are added to
+// regions if it isn't NULL. The frame is empty if none of them is visible.
+DrmHwcRect<int> DrmDisplayCompositor::GetPreCompFrame(
+    DrmDisplayComposition *display_comp, DrmCompositionPlane &comp_plane,
+    uint32_t width, uint32_t height,
+    std::vector<DrmCompositionRegion> *regions) {
+  std::vector<size_t> &source_layers = comp_plane.source_layers();
+  DrmHwcRect<int> frame(0, 0, 0, 0);
+  bool visible = false;
+  for (const DrmCompositionRegion &region : display_comp->pre_comp_regions()) {
+    if (region.source_layers.empty() ||
+        std::find(source_layers.begin(), source_layers.end(),
+                  region.source_layers.front()) == source_layers.end())
+      continue;
+
+    if (!visible) {
+      frame = region.frame;
+    } else {
+      frame.left = std::min(frame.left, region.frame.left);
+      frame.top = std::min(frame.top, region.frame.top);
+      frame.right = std::max(frame.right, region.frame.right);
+      frame.bottom = std::max(frame.bottom, region.frame.bottom);
+    }
+    visible = true;
+    if (regions)
+      regions->emplace_back(region);
+  }
+  if (!visible)
+    return DrmHwcRect<int>(0, 0, 0, 0);
+
+  // Primary planes often have to cover the whole display
+  if (comp_plane.plane()->type() == DRM_PLANE_TYPE_PRIMARY)
+    return DrmHwcRect<int>(0, 0, width, height);
+
+  frame.left = std::max(frame.left, 0);
+  frame.top = std::max(frame.top, 0);
+  frame.right = std::min(frame.right, (int)width);
+  frame.bottom = std::min(frame.bottom, (int)height);
+  if (frame.width() <= 0 || frame.height() <= 0)
+    return DrmHwcRect<int>(0, 0, 0, 0);
+  return frame;
+}
+
+// Renders each precomp plane's layers into a framebuffer of its own and
+// replaces the plane's source layers with it. Only the regions of the display
+// the layers are visible in are scanned out.
 int DrmDisplayCompositor::ApplyPreComposite(
     DrmDisplayComposition *display_comp) {
-  int ret = 0;
-
-  DrmFramebuffer &fb = framebuffers_[framebuffer_index_];
-  ret = PrepareFramebuffer(fb, display_comp);
+  uint32_t width, height;
+  int ret;
+  std::tie(width, height, ret) = GetActiveModeResolution();
   if (ret) {
-    ALOGE("Failed to prepare framebuffer for pre-composite %d", ret);
+    ALOGE("Failed to get display resolution for pre-composite %d", ret);
     return ret;
   }
 
-  std::vector<DrmCompositionRegion> &regions = display_comp->pre_comp_regions();
-  if (pre_compositor_) {
-    ret = pre_compositor_->Composite(display_comp->layers().data(),
-                                   regions.data(), regions.size(), fb.buffer(),
-                                   display_comp->importer());
-    pre_compositor_->Finish();
+  size_t precomp_index = 0;
+  for (DrmCompositionPlane &comp_plane : display_comp->composition_planes()) {
+    if (comp_plane.type() != DrmCompositionPlane::Type::kPrecomp)
+      continue;
+    if (precomp_index >= DRM_MAX_PRECOMP_PLANES) {
+      ALOGE("Can't pre-composite more than %d planes", DRM_MAX_PRECOMP_PLANES);
+      return -EINVAL;
+    }
+
+    std::vector<size_t> &source_layers = comp_plane.source_layers();
+    std::vector<DrmCompositionRegion> regions;
+    DrmHwcRect<int> frame =
+        GetPreCompFrame(display_comp, comp_plane, width, height, &regions);
+    if (frame.width() <= 0 || frame.height() <= 0) {
+      // None of the layers is visible
+      comp_plane = DrmCompositionPlane(DrmCompositionPlane::Type::kDisable,
+                                       comp_plane.plane(), comp_plane.crtc());
+      continue;
+    }
 
+    DrmFramebuffer &fb = framebuffers_[precomp_index++][framebuffer_index_];
+    ret = PrepareFramebuffer(fb, display_comp, &frame);
     if (ret) {
-      ALOGE("Failed to pre-composite layers");
+      ALOGE("Failed to prepare framebuffer for pre-composite %d", ret);
       return ret;
     }
-  }
 
-  ret = display_comp->CreateNextTimelineFence();
-  if (ret <= 0) {
-    ALOGE("Failed to create pre-composite framebuffer release fence %d", ret);
-    return ret;
+    if (pre_compositor_) {
+      ret = pre_compositor_->Composite(display_comp->layers().data(),
+                                       regions.data(), regions.size(),
+                                       fb.buffer(), display_comp->importer());
+      if (ret) {
+        pre_compositor_->Finish();
+        ALOGE("Failed to pre-composite layers");
+        return ret;
+      }
+    }
+
+    ret = display_comp->CreateNextTimelineFence();
+    if (ret <= 0) {
+      ALOGE("Failed to create pre-composite framebuffer release fence %d", ret);
+      return ret;
+    }
+    fb.set_release_fence_fd(ret);
+
+    // Replace source_layers with the output of the precomposite
+    source_layers.clear();
+    source_layers.push_back(display_comp->layers().size() - 1);
   }
 
-  fb.set_release_fence_fd(ret);
+  if (pre_compositor_)
+    pre_compositor_->Finish();
   display_comp->SignalPreCompDone();
 
   return 0;
 }
 
 int DrmDisplayCompositor::DisablePlanes(DrmDisplayComposition *display_comp) {
-  drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
-  if (!pset) {
-    ALOGE("Failed to allocate property set");
-    return -ENOMEM;
-  }
+  // Callers go on to release the active composition
+  WaitForFlip();
+
+  DrmPropertySet &pset = property_set_;
+  int ret = pset.Begin();
+  if (ret)
+    return ret;
 
-  int ret;
   std::vector<DrmCompositionPlane> &comp_planes =
       display_comp->composition_planes();
   for (DrmCompositionPlane &comp_plane : comp_planes) {
     DrmPlane *plane = comp_plane.plane();
-    ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                   plane->crtc_property().id(), 0) < 0 ||
-          drmModeAtomicAddProperty(pset, plane->id(), plane->fb_property().id(),
-                                   0) < 0;
+    ret = pset.Add(plane->id(), plane->crtc_property().id(), 0) < 0 ||
+          pset.Add(plane->id(), plane->fb_property().id(), 0) < 0;
     if (ret) {
       ALOGE("Failed to add plane %d disable to pset", plane->id());
-      drmModeAtomicFree(pset);
       return ret;
     }
   }
 
-  ret = drmModeAtomicCommit(drm_->fd(), pset, 0, drm_);
+  ret = pset.Commit(drm_->fd(), 0, drm_);
   if (ret) {
     ALOGE("Failed to commit pset ret=%d\n", ret);
-    drmModeAtomicFree(pset);
     return ret;
   }
 
-  drmModeAtomicFree(pset);
+  // The planes are up for grabs now, whatever they're set to next time we
+  // get them is unknown
+  for (DrmCompositionPlane &comp_plane : comp_planes)
+    pset.Forget(comp_plane.plane()->id());
+
   return 0;
 }
 
@@ -403,8 +610,6 @@ int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp) {
       display_comp->composition_planes();
   std::vector<DrmCompositionRegion> &squash_regions =
       display_comp->squash_regions();
-  std::vector<DrmCompositionRegion> &pre_comp_regions =
-      display_comp->pre_comp_regions();
 
   int squash_layer_index = -1;
   if (squash_regions.size() > 0) {
@@ -420,12 +625,12 @@ int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp) {
       layers.emplace_back();
       squash_layer_index = layers.size() - 1;
       DrmHwcLayer &squash_layer = layers.back();
-      ret = squash_layer.buffer.ImportBuffer(fb.buffer()->handle,
-                                             display_comp->importer());
+      ret = fb.ImportBuffer(display_comp->importer());
       if (ret) {
         ALOGE("Failed to import old squashed framebuffer %d", ret);
         return ret;
       }
+      squash_layer.buffer = fb.imported_buffer();
       squash_layer.sf_handle = fb.buffer()->handle;
       squash_layer.blending = DrmHwcBlending::kPreMult;
       squash_layer.source_crop = DrmHwcRect<float>(
@@ -444,14 +649,15 @@ int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp) {
     }
   }
 
-  bool do_pre_comp = pre_comp_regions.size() > 0;
-  int pre_comp_layer_index = -1;
+  bool do_pre_comp = std::any_of(comp_planes.begin(), comp_planes.end(),
+                                 [](const DrmCompositionPlane &p) {
+    return p.type() == DrmCompositionPlane::Type::kPrecomp;
+  });
   if (do_pre_comp) {
     ret = ApplyPreComposite(display_comp);
     if (ret)
       return ret;
 
-    pre_comp_layer_index = layers.size() - 1;
     framebuffer_index_ = (framebuffer_index_ + 1) % DRM_DISPLAY_BUFFERS;
   }
 
@@ -464,17 +670,6 @@ int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp) {
                 source_layers[0], squash_layer_index);
         source_layers.push_back(squash_layer_index);
         break;
-      case DrmCompositionPlane::Type::kPrecomp:
-        if (!do_pre_comp) {
-          ALOGE(
-              "Can not use pre composite framebuffer with no pre composite "
-              "regions");
-          return -EINVAL;
-        }
-        // Replace source_layers with the output of the precomposite
-        source_layers.clear();
-        source_layers.push_back(pre_comp_layer_index);
-        break;
       default:
         break;
     }
@@ -484,7 +679,7 @@ int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp) {
 }
 
 int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
-                                      bool test_only) {
+                                      bool test_only, DrmHwcLayer *test_layer) {
   ATRACE_CALL();
 
   int ret = 0;
@@ -493,6 +688,8 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
   std::vector<DrmCompositionPlane> &comp_planes =
       display_comp->composition_planes();
   uint64_t out_fences[drm_->crtcs().size()];
+  // Layers of the active composition standing in for late ones
+  std::vector<DrmHwcLayer *> stale_layers(comp_planes.size(), NULL);
 
   DrmConnector *connector = drm_->GetConnectorForDisplay(display_);
   if (!connector) {
@@ -505,43 +702,45 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     return -ENODEV;
   }
 
-  drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
-  if (!pset) {
-    ALOGE("Failed to allocate property set");
-    return -ENOMEM;
+  // The kernel rejects nonblocking commits while the previous one is pending
+  if (!test_only) {
+    WaitForFlip();
+    LatchStaleLayers(display_comp, &stale_layers);
   }
 
+  DrmPropertySet &pset = property_set_;
+  ret = pset.Begin();
+  if (ret)
+    return ret;
+
   if (crtc->out_fence_ptr_property().id() != 0) {
-    ret = drmModeAtomicAddProperty(pset, crtc->id(), crtc->out_fence_ptr_property().id(),
-                                   (uint64_t) &out_fences[crtc->pipe()]);
+    ret = pset.Add(crtc->id(), crtc->out_fence_ptr_property().id(),
+                   (uint64_t)&out_fences[crtc->pipe()], true);
     if (ret < 0) {
       ALOGE("Failed to add OUT_FENCE_PTR property to pset: %d", ret);
-      drmModeAtomicFree(pset);
       return ret;
     }
   }
 
   if (mode_.needs_modeset) {
-    ret = drmModeAtomicAddProperty(pset, crtc->id(), crtc->active_property().id(), 1);
+    ret = pset.Add(crtc->id(), crtc->active_property().id(), 1, true);
     if (ret < 0) {
       ALOGE("Failed to add crtc active to pset\n");
-      drmModeAtomicFree(pset);
       return ret;
     }
 
-    ret = drmModeAtomicAddProperty(pset, crtc->id(), crtc->mode_property().id(),
-                                   mode_.blob_id) < 0 ||
-          drmModeAtomicAddProperty(pset, connector->id(),
-                                   connector->crtc_id_property().id(),
-                                   crtc->id()) < 0;
+    ret = pset.Add(crtc->id(), crtc->mode_property().id(), mode_.blob_id,
+                   true) < 0 ||
+          pset.Add(connector->id(), connector->crtc_id_property().id(),
+                   crtc->id(), true) < 0;
     if (ret) {
       ALOGE("Failed to add blob %d to pset", mode_.blob_id);
-      drmModeAtomicFree(pset);
       return ret;
     }
   }
 
-  for (DrmCompositionPlane &comp_plane : comp_planes) {
+  for (size_t i = 0; i < comp_planes.size(); ++i) {
+    DrmCompositionPlane &comp_plane = comp_planes[i];
     DrmPlane *plane = comp_plane.plane();
     DrmCrtc *crtc = comp_plane.crtc();
     std::vector<size_t> &source_layers = comp_plane.source_layers();
@@ -554,18 +753,28 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     uint64_t alpha = 0xFF;
 
     if (comp_plane.type() != DrmCompositionPlane::Type::kDisable) {
-      if (source_layers.size() > 1) {
+      // The precomp and squash planes haven't been rendered yet when testing
+      // a plan, so they scan out test_layer instead
+      bool use_test_layer =
+          test_layer &&
+          (comp_plane.type() == DrmCompositionPlane::Type::kPrecomp ||
+           comp_plane.type() == DrmCompositionPlane::Type::kSquash);
+      if (!use_test_layer && source_layers.size() > 1) {
         ALOGE("Can't handle more than one source layer sz=%zu type=%d",
               source_layers.size(), comp_plane.type());
         continue;
       }
 
-      if (source_layers.empty() || source_layers.front() >= layers.size()) {
+      if (!use_test_layer &&
+          (source_layers.empty() || source_layers.front() >= layers.size())) {
         ALOGE("Source layer index %zu out of bounds %zu type=%d",
               source_layers.front(), layers.size(), comp_plane.type());
         break;
       }
-      DrmHwcLayer &layer = layers[source_layers.front()];
+      DrmHwcLayer &layer =
+          use_test_layer ? *test_layer
+                         : stale_layers[i] ? *stale_layers[i]
+                                           : layers[source_layers.front()];
       if (!layer.buffer) {
         ALOGE("Expected a valid framebuffer for pset");
         break;
@@ -574,6 +783,19 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
       fence_fd = layer.acquire_fence.get();
       display_frame = layer.display_frame;
       source_crop = layer.source_crop;
+
+      // Scan out the part of test_layer ApplyPreComposite would render to
+      if (use_test_layer &&
+          comp_plane.type() == DrmCompositionPlane::Type::kPrecomp) {
+        display_frame = GetPreCompFrame(
+            display_comp, comp_plane, test_layer->display_frame.width(),
+            test_layer->display_frame.height(), NULL);
+        source_crop =
+            DrmHwcRect<float>(display_frame.left, display_frame.top,
+                              display_frame.right, display_frame.bottom);
+        if (display_frame.width() <= 0 || display_frame.height() <= 0)
+          fb_id = -1;
+      }
       if (layer.blending == DrmHwcBlending::kPreMult)
         alpha = layer.alpha;
 
@@ -597,7 +819,7 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
                 ALOGE("Failed to get IN_FENCE_FD property id");
                 break;
         }
-        ret = drmModeAtomicAddProperty(pset, plane->id(), prop_id, fence_fd);
+        ret = pset.Add(plane->id(), prop_id, fence_fd, true);
         if (ret < 0) {
           ALOGE("Failed to add IN_FENCE_FD property to pset: %d", ret);
           break;
@@ -607,10 +829,8 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
 
     // Disable the plane if there's no framebuffer
     if (fb_id < 0) {
-      ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->crtc_property().id(), 0) < 0 ||
-            drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->fb_property().id(), 0) < 0;
+      ret = pset.Add(plane->id(), plane->crtc_property().id(), 0) < 0 ||
+            pset.Add(plane->id(), plane->fb_property().id(), 0) < 0;
       if (ret) {
         ALOGE("Failed to add plane %d disable to pset", plane->id());
         break;
@@ -632,43 +852,38 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
       break;
     }
 
-    ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                   plane->crtc_property().id(), crtc->id()) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->fb_property().id(), fb_id) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->crtc_x_property().id(),
-                                    display_frame.left) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->crtc_y_property().id(),
-                                    display_frame.top) < 0;
-    ret |= drmModeAtomicAddProperty(
-               pset, plane->id(), plane->crtc_w_property().id(),
-               display_frame.right - display_frame.left) < 0;
-    ret |= drmModeAtomicAddProperty(
-               pset, plane->id(), plane->crtc_h_property().id(),
-               display_frame.bottom - display_frame.top) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->src_x_property().id(),
-                                    (int)(source_crop.left) << 16) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->src_y_property().id(),
-                                    (int)(source_crop.top) << 16) < 0;
-    ret |= drmModeAtomicAddProperty(
-               pset, plane->id(), plane->src_w_property().id(),
-               (int)(source_crop.right - source_crop.left) << 16) < 0;
-    ret |= drmModeAtomicAddProperty(
-               pset, plane->id(), plane->src_h_property().id(),
-               (int)(source_crop.bottom - source_crop.top) << 16) < 0;
+    // MoveCursor positions cursor planes without going through the set
+    bool force_position = plane->type() == DRM_PLANE_TYPE_CURSOR;
+
+    // Removing a framebuffer detaches it from its plane in the kernel, and
+    // fb ids get recycled, so the plane's crtc and fb are always sent
+    ret = pset.Add(plane->id(), plane->crtc_property().id(), crtc->id(),
+                   true) < 0;
+    ret |= pset.Add(plane->id(), plane->fb_property().id(), fb_id, true) < 0;
+    ret |= pset.Add(plane->id(), plane->crtc_x_property().id(),
+                    display_frame.left, force_position) < 0;
+    ret |= pset.Add(plane->id(), plane->crtc_y_property().id(),
+                    display_frame.top, force_position) < 0;
+    ret |= pset.Add(plane->id(), plane->crtc_w_property().id(),
+                    display_frame.right - display_frame.left) < 0;
+    ret |= pset.Add(plane->id(), plane->crtc_h_property().id(),
+                    display_frame.bottom - display_frame.top) < 0;
+    ret |= pset.Add(plane->id(), plane->src_x_property().id(),
+                    (int)(source_crop.left) << 16) < 0;
+    ret |= pset.Add(plane->id(), plane->src_y_property().id(),
+                    (int)(source_crop.top) << 16) < 0;
+    ret |= pset.Add(plane->id(), plane->src_w_property().id(),
+                    (int)(source_crop.right - source_crop.left) << 16) < 0;
+    ret |= pset.Add(plane->id(), plane->src_h_property().id(),
+                    (int)(source_crop.bottom - source_crop.top) << 16) < 0;
     if (ret) {
       ALOGE("Failed to add plane %d to set", plane->id());
       break;
     }
 
     if (plane->rotation_property().id()) {
-      ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->rotation_property().id(),
-                                     rotation) < 0;
+      ret = pset.Add(plane->id(), plane->rotation_property().id(), rotation) <
+            0;
       if (ret) {
         ALOGE("Failed to add rotation property %d to plane %d",
               plane->rotation_property().id(), plane->id());
@@ -677,15 +892,23 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     }
 
     if (plane->alpha_property().id()) {
-      ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->alpha_property().id(),
-                                     alpha) < 0;
+      ret = pset.Add(plane->id(), plane->alpha_property().id(), alpha) < 0;
       if (ret) {
         ALOGE("Failed to add alpha property %d to plane %d",
               plane->alpha_property().id(), plane->id());
         break;
       }
     }
+
+    if (comp_plane.zpos() >= 0 && plane->has_mutable_zpos()) {
+      ret = pset.Add(plane->id(), plane->zpos_property().id(),
+                     comp_plane.zpos()) < 0;
+      if (ret) {
+        ALOGE("Failed to add zpos property %d to plane %d",
+              plane->zpos_property().id(), plane->id());
+        break;
+      }
+    }
   }
 
   if (!ret) {
@@ -693,18 +916,68 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     if (test_only)
       flags |= DRM_MODE_ATOMIC_TEST_ONLY;
 
-    ret = drmModeAtomicCommit(drm_->fd(), pset, flags, drm_);
+    // Hand the frame to the kernel and let FlipDone finish up once it's on
+    // the screen. Modesets stay blocking, since ApplyDpms has to follow them.
+    DrmFlipEvent *flip_event = NULL;
+    if (!test_only && UseNonblockingCommit()) {
+      // Flip events only come for the crtcs in the commit, which ours might
+      // not be if no property of it or its planes changed
+      ret = pset.Add(crtc->id(), crtc->active_property().id(), 1, true);
+      if (ret < 0) {
+        ALOGE("Failed to add crtc active to pset %d", ret);
+        return ret;
+      }
+
+      flags |= DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+      pthread_mutex_lock(&flip_lock_);
+      flip_event = new DrmFlipEvent(flip_target_, ++flip_seq_);
+      flip_pending_ = true;
+      flip_composition_ = display_comp;
+      // A composition we latched buffers of stays on the screen
+      flip_retire_ =
+          display_comp->stale_layers() ? NULL : active_composition_.get();
+      pthread_mutex_unlock(&flip_lock_);
+    }
+
+    // Frames may go to the kernel along with other displays' frames
+    void *user_data = flip_event ? (void *)flip_event : (void *)drm_;
+    if (test_only) {
+      ret = pset.Commit(drm_->fd(), flags, user_data);
+    } else {
+      ret = drm_->commit_merger()->Commit(display_, crtc->id(), pset.request(),
+                                          flags, user_data);
+      // The kernel turns nonblocking commits down while a cursor update it
+      // took in the same vblank is pending, wait for it instead of dropping
+      // the frame
+      if (ret == -EBUSY && (flags & DRM_MODE_ATOMIC_NONBLOCK)) {
+        ATRACE_NAME("BlockingRetry");
+        ++busy_retries_;
+        ret = drm_->commit_merger()->Commit(
+            display_, crtc->id(), pset.request(),
+            flags & ~DRM_MODE_ATOMIC_NONBLOCK, user_data);
+      }
+      if (!ret) {
+        pset.Committed();
+        // Other displays may commit the planes we gave back from now on
+        for (DrmPlane *plane : display_comp->released_planes())
+          pset.Forget(plane->id());
+      }
+    }
+    if (ret && flip_event) {
+      pthread_mutex_lock(&flip_lock_);
+      flip_pending_ = false;
+      flip_composition_ = flip_retire_ = NULL;
+      pthread_mutex_unlock(&flip_lock_);
+      delete flip_event;
+    }
     if (ret) {
       if (test_only)
         ALOGI("Commit test pset failed ret=%d\n", ret);
       else
         ALOGE("Failed to commit pset ret=%d\n", ret);
-      drmModeAtomicFree(pset);
       return ret;
     }
   }
-  if (pset)
-    drmModeAtomicFree(pset);
 
   if (!test_only && mode_.needs_modeset) {
     ret = drm_->DestroyPropertyBlob(mode_.old_blob_id);
@@ -727,13 +1000,264 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     mode_.needs_modeset = false;
   }
 
-  if (crtc->out_fence_ptr_property().id()) {
+  if (!test_only && crtc->out_fence_ptr_property().id()) {
     display_comp->set_out_fence((int) out_fences[crtc->pipe()]);
   }
 
   return ret;
 }
 
+int DrmDisplayCompositor::PrepareTestLayer(
+    DrmHwcLayer *test_layer, DrmDisplayComposition *display_comp) {
+  uint32_t width, height;
+  int ret;
+  std::tie(width, height, ret) = GetActiveModeResolution();
+  if (ret)
+    return ret;
+
+  // The next precomp framebuffer is exactly what ApplyPreComposite is going
+  // to allocate. CommitFrame and GetPlanSignature crop it to each precomp
+  // plane's frame, the squash plane scans out all of it.
+  DrmFramebuffer &fb = framebuffers_[0][framebuffer_index_];
+  if (!fb.Allocate(width, height, framebuffer_usage_)) {
+    ALOGE("Failed to allocate framebuffer with size %dx%d", width, height);
+    return -ENOMEM;
+  }
+  ret = fb.ImportBuffer(display_comp->importer());
+  if (ret) {
+    ALOGE("Failed to import framebuffer for plan test %d", ret);
+    return ret;
+  }
+
+  test_layer->buffer = fb.imported_buffer();
+  test_layer->sf_handle = fb.buffer()->handle;
+  test_layer->blending = DrmHwcBlending::kPreMult;
+  test_layer->source_crop = DrmHwcRect<float>(0, 0, width, height);
+  test_layer->display_frame = DrmHwcRect<int>(0, 0, width, height);
+  return 0;
+}
+
+// frame stands in for both the source crop and display frame of layer if it
+// isn't NULL
+static void AddLayerSignature(const DrmHwcLayer &layer,
+                              const DrmHwcRect<int> *frame,
+                              std::vector<uint64_t> *signature) {
+  signature->push_back(layer.buffer->format);
+  signature->push_back(layer.buffer->modifiers[0]);
+  if (frame) {
+    signature->push_back(frame->width());
+    signature->push_back(frame->height());
+    signature->push_back(frame->width());
+    signature->push_back(frame->height());
+  } else {
+    signature->push_back((uint64_t)layer.source_crop.width());
+    signature->push_back((uint64_t)layer.source_crop.height());
+    signature->push_back(layer.display_frame.width());
+    signature->push_back(layer.display_frame.height());
+  }
+  signature->push_back(layer.transform);
+  signature->push_back(layer.blending == DrmHwcBlending::kPreMult ? layer.alpha
+                                                                  : 0xff);
+}
+
+std::vector<uint64_t> DrmDisplayCompositor::GetPlanSignature(
+    DrmDisplayComposition *display_comp, const DrmHwcLayer &test_layer) {
+  std::vector<uint64_t> signature;
+  signature.push_back(mode_.needs_modeset ? mode_.mode.id() : 0);
+
+  uint32_t width = test_layer.display_frame.width();
+  uint32_t height = test_layer.display_frame.height();
+  std::vector<DrmHwcLayer> &layers = display_comp->layers();
+  for (DrmCompositionPlane &comp_plane : display_comp->composition_planes()) {
+    signature.push_back(comp_plane.plane()->id());
+    signature.push_back((uint64_t)comp_plane.type());
+    signature.push_back(comp_plane.zpos());
+    switch (comp_plane.type()) {
+      case DrmCompositionPlane::Type::kLayer:
+        if (!comp_plane.source_layers().empty() &&
+            layers[comp_plane.source_layers().front()].buffer)
+          AddLayerSignature(layers[comp_plane.source_layers().front()], NULL,
+                            &signature);
+        break;
+      case DrmCompositionPlane::Type::kPrecomp: {
+        // An empty frame means the plane is going to be disabled
+        DrmHwcRect<int> frame =
+            GetPreCompFrame(display_comp, comp_plane, width, height, NULL);
+        AddLayerSignature(test_layer, &frame, &signature);
+        break;
+      }
+      case DrmCompositionPlane::Type::kSquash:
+        AddLayerSignature(test_layer, NULL, &signature);
+        break;
+      default:
+        break;
+    }
+  }
+  return signature;
+}
+
+int DrmDisplayCompositor::SearchPlan(DrmDisplayComposition *display_comp) {
+  ATRACE_CALL();
+  DrmHwcLayer test_layer;
+  int ret = PrepareTestLayer(&test_layer, display_comp);
+  if (ret)
+    return ret;
+
+  unsigned num_tests = 0;
+  while (true) {
+    std::vector<uint64_t> signature =
+        GetPlanSignature(display_comp, test_layer);
+    auto verdict = plan_verdicts_.find(signature);
+    if (verdict != plan_verdicts_.end()) {
+      ret = verdict->second;
+      ++plan_verdict_hits_;
+    } else if (num_tests < kMaxPlanTests) {
+      ret = CommitFrame(display_comp, true, &test_layer);
+      ++num_tests;
+      ++plan_tests_;
+
+      // Only remember verdicts on the configuration itself, not transient
+      // failures
+      if (!ret || ret == -EINVAL || ret == -ERANGE) {
+        if (plan_verdicts_.size() >= kMaxPlanVerdicts)
+          plan_verdicts_.clear();
+        plan_verdicts_.emplace(std::move(signature), ret);
+      }
+    } else {
+      return ret;
+    }
+
+    if (!ret)
+      return 0;
+
+    // Without GL there's nothing to demote layers into
+    if (!pre_compositor_ || display_comp->DemoteTopLayer())
+      return ret;
+  }
+}
+
+int DrmDisplayCompositor::GetLatchDeadline(int64_t *deadline_ns) {
+  DrmCrtc *crtc = drm_->GetCrtcForDisplay(display_);
+  if (!crtc)
+    return -ENODEV;
+
+  // A relative wait for no vblank at all returns the last one right away
+  uint32_t high_crtc = (crtc->pipe() << DRM_VBLANK_HIGH_CRTC_SHIFT);
+  drmVBlank vblank;
+  memset(&vblank, 0, sizeof(vblank));
+  vblank.request.type = (drmVBlankSeqType)(
+      DRM_VBLANK_RELATIVE | (high_crtc & DRM_VBLANK_HIGH_CRTC_MASK));
+  vblank.request.sequence = 0;
+  int ret = drmWaitVBlank(drm_->fd(), &vblank);
+  if (ret)
+    return ret;
+
+  struct timespec ts;
+  ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+  if (ret)
+    return ret;
+
+  const int64_t kOneSecondNs = 1000 * 1000 * 1000;
+  float refresh = mode_.mode.v_refresh();
+  if (refresh <= 0.0f)
+    refresh = 60.0f;
+  int64_t frame_ns = kOneSecondNs / refresh;
+  int64_t last_vblank_ns = (int64_t)vblank.reply.tval_sec * kOneSecondNs +
+                           (int64_t)vblank.reply.tval_usec * 1000;
+  int64_t now_ns = (int64_t)ts.tv_sec * kOneSecondNs + ts.tv_nsec;
+
+  // The first vblank we can still make, leaving the margin for the commit
+  int64_t elapsed_ns = std::max<int64_t>(0, now_ns + latch_margin_ns_ -
+                                                last_vblank_ns);
+  int64_t target_ns = last_vblank_ns + frame_ns * (elapsed_ns / frame_ns + 1);
+  *deadline_ns = target_ns - latch_margin_ns_;
+  return 0;
+}
+
+// Layers on dedicated planes whose acquire fence is still pending at the
+// deadline for the next vblank are swapped for the layer the active composition
+// shows on the same plane, so that one late buffer doesn't hold back the flip
+// of the whole display. Only a layer with the same geometry can stand in.
+void DrmDisplayCompositor::LatchStaleLayers(
+    DrmDisplayComposition *display_comp,
+    std::vector<DrmHwcLayer *> *plane_layers) {
+  // Latching twice in a row would chain compositions together
+  if (!latch_stale_ || mode_.needs_modeset || !active_composition_ ||
+      active_composition_->stale_layers())
+    return;
+
+  ATRACE_CALL();
+  std::vector<DrmHwcLayer> &layers = display_comp->layers();
+  std::vector<DrmCompositionPlane> &comp_planes =
+      display_comp->composition_planes();
+  std::vector<DrmHwcLayer> &active_layers = active_composition_->layers();
+  int64_t deadline_ns = -1;
+  size_t stale = 0;
+
+  for (size_t i = 0; i < comp_planes.size(); ++i) {
+    DrmCompositionPlane &comp_plane = comp_planes[i];
+    std::vector<size_t> &source_layers = comp_plane.source_layers();
+    if (comp_plane.type() != DrmCompositionPlane::Type::kLayer ||
+        comp_plane.plane()->type() == DRM_PLANE_TYPE_CURSOR ||
+        source_layers.size() != 1 || source_layers.front() >= layers.size())
+      continue;
+
+    DrmHwcLayer &layer = layers[source_layers.front()];
+    int fence_fd = layer.acquire_fence.get();
+    if (fence_fd < 0)
+      continue;
+
+    DrmHwcLayer *active_layer = NULL;
+    for (DrmCompositionPlane &active_plane :
+         active_composition_->composition_planes()) {
+      std::vector<size_t> &active_sources = active_plane.source_layers();
+      if (active_plane.plane() != comp_plane.plane())
+        continue;
+      if (active_plane.type() == DrmCompositionPlane::Type::kLayer &&
+          active_sources.size() == 1 &&
+          active_sources.front() < active_layers.size())
+        active_layer = &active_layers[active_sources.front()];
+      break;
+    }
+    if (!active_layer || !active_layer->buffer ||
+        !(active_layer->display_frame == layer.display_frame) ||
+        !(active_layer->source_crop == layer.source_crop) ||
+        active_layer->transform != layer.transform ||
+        active_layer->blending != layer.blending)
+      continue;
+
+    if (deadline_ns < 0 && GetLatchDeadline(&deadline_ns)) {
+      // Without vblank timestamps there's no deadline to hold layers to
+      deadline_ns = -1;
+      break;
+    }
+
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+      break;
+    int64_t now_ns = (int64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+    int timeout_ms = std::max<int64_t>(0, deadline_ns - now_ns) / 1000000;
+
+    struct pollfd fd = {.fd = fence_fd, .events = POLLIN, .revents = 0};
+    int ret;
+    do {
+      ret = poll(&fd, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+    if (ret != 0)
+      continue;
+
+    (*plane_layers)[i] = active_layer;
+    ++stale;
+  }
+
+  display_comp->set_stale_layers(stale);
+  if (stale) {
+    ALOGV("Latched %zu stale layers on display %d", stale, display_);
+    ++stale_frames_;
+    stale_layers_ += stale;
+  }
+}
+
 int DrmDisplayCompositor::ApplyDpms(DrmDisplayComposition *display_comp) {
   DrmConnector *conn = drm_->GetConnectorForDisplay(display_);
   if (!conn) {
@@ -768,26 +1292,29 @@ std::tuple<int, uint32_t> DrmDisplayCompositor::CreateModeBlob(
   return std::make_tuple(ret, id);
 }
 
-void DrmDisplayCompositor::ClearDisplay() {
+int DrmDisplayCompositor::ClearDisplay() {
   AutoLock lock(&lock_, "compositor");
   int ret = lock.Lock();
   if (ret)
-    return;
+    return ret;
 
   if (!active_composition_)
-    return;
+    return 0;
 
-  if (DisablePlanes(active_composition_.get()))
-    return;
+  ret = DisablePlanes(active_composition_.get());
+  if (ret)
+    return ret;
 
   active_composition_->SignalCompositionDone();
 
   active_composition_.reset(NULL);
+  return 0;
 }
 
 void DrmDisplayCompositor::ApplyFrame(
     std::unique_ptr<DrmDisplayComposition> composition, int status) {
   int ret = status;
+  bool nonblocking = UseNonblockingCommit();
 
   if (!ret)
     ret = CommitFrame(composition.get(), false);
@@ -801,19 +1328,82 @@ void DrmDisplayCompositor::ApplyFrame(
   }
   ++dump_frames_composited_;
 
-  if (active_composition_)
-    active_composition_->SignalCompositionDone();
+  // The previous composition is off the screen now, and this one doesn't use
+  // the layers it culled. After a nonblocking commit, FlipDone takes care of
+  // that once the flip happened. If we latched buffers of the previous
+  // composition, it's released along with this one instead.
+  bool latched = composition->stale_layers() > 0;
+  if (!nonblocking) {
+    composition->SignalCulledDone();
+
+    if (active_composition_ && !latched)
+      active_composition_->SignalCompositionDone();
+  }
 
   ret = pthread_mutex_lock(&lock_);
   if (ret)
     ALOGE("Failed to acquire lock for active_composition swap");
 
+  if (latched)
+    composition->set_stale_source(std::move(active_composition_));
   active_composition_.swap(composition);
 
   if (!ret)
     ret = pthread_mutex_unlock(&lock_);
   if (ret)
     ALOGE("Failed to release lock for active_composition swap");
+
+  // Kept around until the flip is done
+  if (nonblocking)
+    retired_composition_ = std::move(composition);
+}
+
+void DrmDisplayCompositor::FlipDone(uint64_t flip_seq) {
+  ATRACE_CALL();
+  pthread_mutex_lock(&flip_lock_);
+  // WaitForFlip may have given up on this one already
+  if (flip_pending_ && flip_seq == flip_seq_) {
+    ++flips_;
+    FinishFlipLocked();
+  }
+  pthread_mutex_unlock(&flip_lock_);
+}
+
+void DrmDisplayCompositor::FinishFlipLocked() {
+  if (flip_composition_)
+    flip_composition_->SignalCulledDone();
+  if (flip_retire_)
+    flip_retire_->SignalCompositionDone();
+  flip_composition_ = flip_retire_ = NULL;
+  flip_pending_ = false;
+  pthread_cond_broadcast(&flip_cond_);
+}
+
+void DrmDisplayCompositor::WaitForFlip() {
+  pthread_mutex_lock(&flip_lock_);
+  if (flip_pending_) {
+    ATRACE_NAME("WaitForFlip");
+    struct timespec timeout;
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec += kFlipTimeoutMs / 1000;
+    timeout.tv_nsec += (kFlipTimeoutMs % 1000) * 1000 * 1000;
+    if (timeout.tv_nsec >= 1000 * 1000 * 1000) {
+      timeout.tv_nsec -= 1000 * 1000 * 1000;
+      ++timeout.tv_sec;
+    }
+
+    int ret = 0;
+    while (flip_pending_ && ret != ETIMEDOUT)
+      ret = pthread_cond_timedwait(&flip_cond_, &flip_lock_, &timeout);
+    if (flip_pending_) {
+      ALOGE("Timed out waiting for the flip of display %d", display_);
+      ++flip_timeouts_;
+      FinishFlipLocked();
+    }
+  }
+  pthread_mutex_unlock(&flip_lock_);
+
+  retired_composition_.reset();
 }
 
 int DrmDisplayCompositor::ApplyComposition(
@@ -821,12 +1411,21 @@ int DrmDisplayCompositor::ApplyComposition(
   int ret = 0;
   switch (composition->type()) {
     case DRM_COMPOSITION_TYPE_FRAME:
+      if (composition->geometry_changed() && plan_search_) {
+        // Settle on a plan the kernel accepts before rendering anything
+        ret = SearchPlan(composition.get());
+        if (ret)
+          ALOGI("No plan passed the commit test, squashing display %d",
+                display_);
+        use_hw_overlays_ = !ret;
+      }
+
       ret = PrepareFrame(composition.get());
       if (ret) {
         ALOGE("Failed to prepare frame for display %d", display_);
         return ret;
       }
-      if (composition->geometry_changed()) {
+      if (composition->geometry_changed() && !plan_search_) {
         // Send the composition to the kernel to ensure we can commit it. This
         // is just a test, it won't actually commit the frame. If rejected,
         // squash the frame into one layer and use the squashed composition
@@ -855,12 +1454,25 @@ int DrmDisplayCompositor::ApplyComposition(
       }
       ApplyFrame(std::move(composition), ret);
       break;
-    case DRM_COMPOSITION_TYPE_DPMS:
+    case DRM_COMPOSITION_TYPE_DPMS: {
       active_ = (composition->dpms_mode() == DRM_MODE_DPMS_ON);
+      drm_->commit_merger()->SetDisplayActive(display_, active_);
+
+      // DPMS alone leaves the planes attached to the crtc, they have to be
+      // disabled before they can be handed to another display
+      int clear_ret = 0;
+      if (!active_) {
+        clear_ret = ClearDisplay();
+        if (clear_ret)
+          ALOGE("Failed to disable planes of display %d %d", display_,
+                clear_ret);
+      }
+
       ret = ApplyDpms(composition.get());
       if (ret)
         ALOGE("Failed to apply dpms for display %d", display_);
-      return ret;
+      return ret ? ret : clear_ret;
+    }
     case DRM_COMPOSITION_TYPE_MODESET:
       mode_.mode = composition->display_mode();
       if (mode_.blob_id)
@@ -880,6 +1492,61 @@ int DrmDisplayCompositor::ApplyComposition(
   return ret;
 }
 
+// Moves the cursor plane of the active composition to x/y without planning,
+// rendering or touching any other plane
+int DrmDisplayCompositor::MoveCursor(int32_t x, int32_t y) {
+  ATRACE_CALL();
+  AutoLock lock(&lock_, "compositor");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  if (!active_composition_)
+    return -ENOENT;
+
+  std::vector<DrmHwcLayer> &layers = active_composition_->layers();
+  for (DrmCompositionPlane &comp_plane :
+       active_composition_->composition_planes()) {
+    DrmPlane *plane = comp_plane.plane();
+    if (comp_plane.type() != DrmCompositionPlane::Type::kLayer ||
+        plane->type() != DRM_PLANE_TYPE_CURSOR ||
+        comp_plane.source_layers().empty())
+      continue;
+
+    DrmHwcLayer &layer = layers[comp_plane.source_layers().front()];
+    DrmHwcRect<int> &frame = layer.display_frame;
+    frame = DrmHwcRect<int>(x, y, x + frame.width(), y + frame.height());
+
+    drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
+    if (!pset) {
+      ALOGE("Failed to allocate property set");
+      return -ENOMEM;
+    }
+
+    ret = drmModeAtomicAddProperty(pset, plane->id(),
+                                   plane->crtc_x_property().id(), x) < 0;
+    ret |= drmModeAtomicAddProperty(pset, plane->id(),
+                                    plane->crtc_y_property().id(), y) < 0;
+    if (ret) {
+      ALOGE("Failed to add cursor plane %d to set", plane->id());
+      drmModeAtomicFree(pset);
+      return -EINVAL;
+    }
+
+    // Don't wait for vblank unless an earlier update is still pending, in
+    // which case dropping this one could leave the cursor behind
+    ret = drmModeAtomicCommit(drm_->fd(), pset, DRM_MODE_ATOMIC_NONBLOCK,
+                              drm_);
+    if (ret == -EBUSY)
+      ret = drmModeAtomicCommit(drm_->fd(), pset, 0, drm_);
+    if (ret)
+      ALOGE("Failed to commit cursor position ret=%d", ret);
+    drmModeAtomicFree(pset);
+    return ret;
+  }
+  return -ENOENT;
+}
+
 int DrmDisplayCompositor::SquashAll() {
   AutoLock lock(&lock_, "compositor");
   int ret = lock.Lock();
@@ -921,8 +1588,6 @@ int DrmDisplayCompositor::SquashFrame(DrmDisplayComposition *src,
   if (src_planes_with_layer <= 1)
     return -EALREADY;
 
-  int pre_comp_layer_index;
-
   int ret = dst->Init(drm_, src->crtc(), src->importer(), src->planner(),
                       src->frame_no());
   if (ret) {
@@ -943,6 +1608,9 @@ int DrmDisplayCompositor::SquashFrame(DrmDisplayComposition *src,
 
     if (comp_plane.plane()->type() == DRM_PLANE_TYPE_PRIMARY)
       squashed_comp.set_plane(comp_plane.plane());
+    else if (std::count(src->released_planes().begin(),
+                        src->released_planes().end(), comp_plane.plane()))
+      dst->AddPlaneRelease(comp_plane.plane());
     else
       dst->AddPlaneDisable(comp_plane.plane());
 
@@ -998,18 +1666,8 @@ int DrmDisplayCompositor::SquashFrame(DrmDisplayComposition *src,
     goto move_layers_back;
   }
 
-  pre_comp_layer_index = dst->layers().size() - 1;
   framebuffer_index_ = (framebuffer_index_ + 1) % DRM_DISPLAY_BUFFERS;
 
-  for (DrmCompositionPlane &plane : dst->composition_planes()) {
-    if (plane.type() == DrmCompositionPlane::Type::kPrecomp) {
-      // Replace source_layers with the output of the precomposite
-      plane.source_layers().clear();
-      plane.source_layers().push_back(pre_comp_layer_index);
-      break;
-    }
-  }
-
   return 0;
 
 // TODO(zachr): think of a better way to transfer ownership back to the active
@@ -1053,6 +1711,23 @@ void DrmDisplayCompositor::Dump(std::ostringstream *out) const {
 
   dump_last_timestamp_ns_ = cur_ts;
 
+  property_set_.Dump(out);
+
+  if (nonblocking_commit_)
+    *out << "----Nonblocking commits: flips=" << flips_
+         << " timeouts=" << flip_timeouts_
+         << " busy_retries=" << busy_retries_ << "\n";
+
+  if (latch_stale_)
+    *out << "----Latched stale: frames=" << stale_frames_
+         << " layers=" << stale_layers_
+         << " margin_us=" << latch_margin_ns_ / 1000 << "\n";
+
+  if (plan_search_)
+    *out << "----Plan search: tests=" << plan_tests_
+         << " cached=" << plan_verdict_hits_
+         << " verdicts=" << plan_verdicts_.size() << "\n";
+
   if (active_composition_)
     active_composition_->Dump(out);
 
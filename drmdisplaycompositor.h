@@ -20,12 +20,15 @@
 #include "drmhwcomposer.h"
 #include "drmdisplaycomposition.h"
 #include "drmframebuffer.h"
+#include "drmpropertyset.h"
 #include "separate_rects.h"
 
 #include <pthread.h>
+#include <map>
 #include <memory>
 #include <sstream>
 #include <tuple>
+#include <vector>
 
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
@@ -79,6 +82,8 @@ class SquashState {
   std::vector<Region> regions_;
 };
 
+struct DrmFlipTarget;
+
 class DrmDisplayCompositor {
  public:
   DrmDisplayCompositor();
@@ -88,10 +93,14 @@ class DrmDisplayCompositor {
 
   std::unique_ptr<DrmDisplayComposition> CreateComposition() const;
   int ApplyComposition(std::unique_ptr<DrmDisplayComposition> composition);
-  int Composite();
   int SquashAll();
+  int MoveCursor(int32_t x, int32_t y);
   void Dump(std::ostringstream *out) const;
 
+  // Called by the event listener once the nonblocking commit numbered
+  // flip_seq is on the screen
+  void FlipDone(uint64_t flip_seq);
+
   std::tuple<uint32_t, uint32_t, int> GetActiveModeResolution();
 
   SquashState *squash_state() {
@@ -116,21 +125,57 @@ class DrmDisplayCompositor {
   static const int kAcquireWaitTries = 5;
   static const int kAcquireWaitTimeoutMs = 100;
 
+  // When the geometry changes, up to kMaxPlanTests plans are tried with a
+  // test commit, demoting the topmost dedicated layer into the precomp plane
+  // after each rejection. Verdicts are remembered per plan signature, of which
+  // we keep up to kMaxPlanVerdicts.
+  static const unsigned kMaxPlanTests = 4;
+  static const size_t kMaxPlanVerdicts = 64;
+
+  // How long we wait for the flip event of a nonblocking commit before giving
+  // up on it
+  static const int kFlipTimeoutMs = 1000;
+
+  // How long before the target vblank a dedicated plane's acquire fence has to
+  // signal, unless hwc.drm.latch_margin_us says otherwise
+  static const int64_t kDefaultLatchMarginNs = 2000000;
+
   int PrepareFramebuffer(DrmFramebuffer &fb,
-                         DrmDisplayComposition *display_comp);
+                         DrmDisplayComposition *display_comp,
+                         const DrmHwcRect<int> *frame = NULL);
   int ApplySquash(DrmDisplayComposition *display_comp);
+  DrmHwcRect<int> GetPreCompFrame(DrmDisplayComposition *display_comp,
+                                  DrmCompositionPlane &comp_plane,
+                                  uint32_t width, uint32_t height,
+                                  std::vector<DrmCompositionRegion> *regions);
   int ApplyPreComposite(DrmDisplayComposition *display_comp);
   int PrepareFrame(DrmDisplayComposition *display_comp);
-  int CommitFrame(DrmDisplayComposition *display_comp, bool test_only);
+  int CommitFrame(DrmDisplayComposition *display_comp, bool test_only,
+                  DrmHwcLayer *test_layer = NULL);
+  int PrepareTestLayer(DrmHwcLayer *test_layer,
+                       DrmDisplayComposition *display_comp);
+  std::vector<uint64_t> GetPlanSignature(DrmDisplayComposition *display_comp,
+                                         const DrmHwcLayer &test_layer);
+  int SearchPlan(DrmDisplayComposition *display_comp);
   int SquashFrame(DrmDisplayComposition *src, DrmDisplayComposition *dst);
   int ApplyDpms(DrmDisplayComposition *display_comp);
   int DisablePlanes(DrmDisplayComposition *display_comp);
+  int GetLatchDeadline(int64_t *deadline_ns);
+  void LatchStaleLayers(DrmDisplayComposition *display_comp,
+                        std::vector<DrmHwcLayer *> *plane_layers);
 
-  void ClearDisplay();
+  bool UseNonblockingCommit() const {
+    return nonblocking_commit_ && !mode_.needs_modeset;
+  }
+  void WaitForFlip();
+  void FinishFlipLocked();
+
+  int ClearDisplay();
   void ApplyFrame(std::unique_ptr<DrmDisplayComposition> composition,
                   int status);
 
   std::tuple<int, uint32_t> CreateModeBlob(const DrmMode &mode);
+  bool PlanesSupportTiledFramebuffers();
 
   DrmResources *drm_;
   int display_;
@@ -143,14 +188,49 @@ class DrmDisplayCompositor {
 
   ModeState mode_;
 
+  // Plane, crtc and connector state as of our last commit, used to only send
+  // the kernel what changed. Only touched by CommitFrame and DisablePlanes.
+  DrmPropertySet property_set_;
+
   int framebuffer_index_;
-  DrmFramebuffer framebuffers_[DRM_DISPLAY_BUFFERS];
+  DrmFramebuffer framebuffers_[DRM_MAX_PRECOMP_PLANES][DRM_DISPLAY_BUFFERS];
+  // Extra gralloc usage for the precomp/squash framebuffers
+  uint32_t framebuffer_usage_ = 0;
   std::unique_ptr<GLWorkerCompositor> pre_compositor_;
 
   SquashState squash_state_;
   int squash_framebuffer_index_;
   DrmFramebuffer squash_framebuffers_[2];
 
+  // Frames are committed with DRM_MODE_ATOMIC_NONBLOCK. The composition they
+  // replace is released from FlipDone, which signals flip_cond_. Until then
+  // flip_retire_ is kept alive in retired_composition_, and flip_composition_
+  // in active_composition_; anything destroying those has to WaitForFlip.
+  bool nonblocking_commit_ = true;
+  pthread_mutex_t flip_lock_;
+  pthread_cond_t flip_cond_;
+  std::shared_ptr<DrmFlipTarget> flip_target_;
+  bool flip_pending_ = false;
+  uint64_t flip_seq_ = 0;
+  DrmDisplayComposition *flip_composition_ = NULL;
+  DrmDisplayComposition *flip_retire_ = NULL;
+  std::unique_ptr<DrmDisplayComposition> retired_composition_;
+  uint64_t flips_ = 0;
+  uint64_t flip_timeouts_ = 0;
+  uint64_t busy_retries_ = 0;
+
+  // Dedicated planes whose acquire fence won't signal in time for the next
+  // vblank keep scanning out the active composition's buffer for a frame
+  bool latch_stale_ = true;
+  int64_t latch_margin_ns_ = kDefaultLatchMarginNs;
+  uint64_t stale_frames_ = 0;
+  uint64_t stale_layers_ = 0;
+
+  bool plan_search_ = true;
+  std::map<std::vector<uint64_t>, int> plan_verdicts_;
+  uint64_t plan_tests_ = 0;
+  uint64_t plan_verdict_hits_ = 0;
+
   // mutable since we need to acquire in Dump()
   mutable pthread_mutex_t lock_;
 
@@ -70,13 +70,14 @@ void DrmEventListener::RegisterHotplugHandler(DrmEventHandler *handler) {
 
 void DrmEventListener::FlipHandler(int /* fd */, unsigned int /* sequence */,
                                    unsigned int tv_sec, unsigned int tv_usec,
-                                   void *user_data) {
+                                   unsigned int crtc_id, void *user_data) {
   DrmEventHandler *handler = (DrmEventHandler *)user_data;
   if (!handler)
     return;
 
-  handler->HandleEvent((uint64_t)tv_sec * 1000 * 1000 + tv_usec);
-  delete handler;
+  handler->HandleFlipEvent(crtc_id, (uint64_t)tv_sec * 1000 * 1000 + tv_usec);
+  if (handler->complete())
+    delete handler;
 }
 
 void DrmEventListener::UEventHandler() {
@@ -121,19 +122,23 @@ void DrmEventListener::UEventHandler() {
 
 void DrmEventListener::Routine() {
   int ret;
+  // select() leaves only the ready descriptors in the set it's given
+  fd_set fds;
   do {
-    ret = select(max_fd_ + 1, &fds_, NULL, NULL, NULL);
+    fds = fds_;
+    ret = select(max_fd_ + 1, &fds, NULL, NULL, NULL);
   } while (ret == -1 && errno == EINTR);
 
-  if (FD_ISSET(drm_->fd(), &fds_)) {
+  if (FD_ISSET(drm_->fd(), &fds)) {
     drmEventContext event_context = {
-        .version = 2,
+        .version = 3,
         .vblank_handler = NULL,
-        .page_flip_handler = DrmEventListener::FlipHandler};
+        .page_flip_handler = NULL,
+        .page_flip_handler2 = DrmEventListener::FlipHandler};
     drmHandleEvent(drm_->fd(), &event_context);
   }
 
-  if (FD_ISSET(uevent_fd_.get(), &fds_))
+  if (FD_ISSET(uevent_fd_.get(), &fds))
     UEventHandler();
 }
 }
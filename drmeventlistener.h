@@ -32,6 +32,17 @@ class DrmEventHandler {
   }
 
   virtual void HandleEvent(uint64_t timestamp_us) = 0;
+
+  // Flip events also say which crtc flipped
+  virtual void HandleFlipEvent(uint32_t /* crtc_id */, uint64_t timestamp_us) {
+    HandleEvent(timestamp_us);
+  }
+
+  // Flip handlers are deleted once this returns true after an event. A commit
+  // spanning several crtcs sends one event per crtc.
+  virtual bool complete() const {
+    return true;
+  }
 };
 
 class DrmEventListener : public Worker {
@@ -45,7 +56,8 @@ class DrmEventListener : public Worker {
   void RegisterHotplugHandler(DrmEventHandler *handler);
 
   static void FlipHandler(int fd, unsigned int sequence, unsigned int tv_sec,
-                          unsigned int tv_usec, void *user_data);
+                          unsigned int tv_usec, unsigned int crtc_id,
+                          void *user_data);
 
  protected:
   virtual void Routine();
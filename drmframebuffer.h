@@ -17,6 +17,8 @@
 #ifndef ANDROID_DRM_FRAMEBUFFER_
 #define ANDROID_DRM_FRAMEBUFFER_
 
+#include "drmhwcomposer.h"
+
 #include <stdint.h>
 
 #include <sync/sync.h>
@@ -46,15 +48,31 @@ struct DrmFramebuffer {
     return release_fence_fd_;
   }
 
+  // Imports the buffer for scanout. The import is kept until the buffer is
+  // reallocated or cleared, so this is a no-op on subsequent calls.
+  int ImportBuffer(Importer *importer) {
+    if (import_)
+      return 0;
+    return import_.ImportBuffer(buffer_->handle, importer);
+  }
+
+  // The import of the buffer, which stays owned by this framebuffer
+  DrmHwcBuffer imported_buffer() const {
+    return import_.Borrow();
+  }
+
   void set_release_fence_fd(int fd) {
     if (release_fence_fd_ >= 0)
       close(release_fence_fd_);
     release_fence_fd_ = fd;
   }
 
-  bool Allocate(uint32_t w, uint32_t h) {
+  // extra_usage is or'ed into the gralloc usage, which is how vendor grallocs
+  // are asked for tiled or compressed layouts.
+  bool Allocate(uint32_t w, uint32_t h, uint32_t extra_usage = 0) {
     if (is_valid()) {
-      if (buffer_->getWidth() == w && buffer_->getHeight() == h)
+      if (buffer_->getWidth() == w && buffer_->getHeight() == h &&
+          extra_usage_ == extra_usage)
         return true;
 
       if (release_fence_fd_ >= 0) {
@@ -67,7 +85,8 @@ struct DrmFramebuffer {
     }
     buffer_ = new GraphicBuffer(w, h, PIXEL_FORMAT_RGBA_8888,
                                 GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_RENDER |
-                                    GRALLOC_USAGE_HW_COMPOSER);
+                                    GRALLOC_USAGE_HW_COMPOSER | extra_usage);
+    extra_usage_ = extra_usage;
     release_fence_fd_ = -1;
     return is_valid();
   }
@@ -81,6 +100,7 @@ struct DrmFramebuffer {
       release_fence_fd_ = -1;
     }
 
+    import_.Clear();
     buffer_.clear();
   }
 
@@ -100,7 +120,9 @@ struct DrmFramebuffer {
 
  private:
   sp<GraphicBuffer> buffer_;
+  DrmHwcBuffer import_;
   int release_fence_fd_;
+  uint32_t extra_usage_ = 0;
 };
 }
 
@@ -27,6 +27,7 @@ typedef struct hwc_drm_bo {
   uint32_t pitches[4];
   uint32_t offsets[4];
   uint32_t gem_handles[4];
+  uint64_t modifiers[4]; /* DRM_FORMAT_MOD_* from drm_fourcc.h */
   uint32_t fb_id;
   int acquire_fence_fd;
   void *priv;
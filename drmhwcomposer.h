@@ -36,9 +36,15 @@ int hwc_import_bo_create(int fd, struct hwc_import_context *ctx,
 bool hwc_import_bo_release(int fd, struct hwc_import_context *ctx,
                            struct hwc_drm_bo *bo);
 
+#include <pthread.h>
+
+#include <map>
+#include <vector>
+
 namespace android {
 
 class Importer;
+class DrmHwcNativeHandleCache;
 
 class DrmHwcBuffer {
  public:
@@ -46,8 +52,10 @@ class DrmHwcBuffer {
   DrmHwcBuffer(const hwc_drm_bo &bo, Importer *importer)
       : bo_(bo), importer_(importer) {
   }
-  DrmHwcBuffer(DrmHwcBuffer &&rhs) : bo_(rhs.bo_), importer_(rhs.importer_) {
+  DrmHwcBuffer(DrmHwcBuffer &&rhs)
+      : bo_(rhs.bo_), importer_(rhs.importer_), borrowed_(rhs.borrowed_) {
     rhs.importer_ = NULL;
+    rhs.borrowed_ = false;
   }
 
   ~DrmHwcBuffer() {
@@ -58,12 +66,14 @@ class DrmHwcBuffer {
     Clear();
     importer_ = rhs.importer_;
     rhs.importer_ = NULL;
+    borrowed_ = rhs.borrowed_;
+    rhs.borrowed_ = false;
     bo_ = rhs.bo_;
     return *this;
   }
 
   operator bool() const {
-    return importer_ != NULL;
+    return importer_ != NULL || borrowed_;
   }
 
   const hwc_drm_bo *operator->() const;
@@ -72,9 +82,15 @@ class DrmHwcBuffer {
 
   int ImportBuffer(buffer_handle_t handle, Importer *importer);
 
+  // Returns a buffer referring to the same bo without owning it. The caller is
+  // responsible for keeping this buffer alive for as long as the borrowed one
+  // is in use.
+  DrmHwcBuffer Borrow() const;
+
  private:
   hwc_drm_bo bo_;
   Importer *importer_ = NULL;
+  bool borrowed_ = false;
 };
 
 class DrmHwcNativeHandle {
@@ -90,6 +106,9 @@ class DrmHwcNativeHandle {
     rhs.gralloc_ = NULL;
     handle_ = rhs.handle_;
     rhs.handle_ = NULL;
+    cache_ = rhs.cache_;
+    rhs.cache_ = NULL;
+    cache_key_ = rhs.cache_key_;
   }
 
   ~DrmHwcNativeHandle();
@@ -100,10 +119,14 @@ class DrmHwcNativeHandle {
     rhs.gralloc_ = NULL;
     handle_ = rhs.handle_;
     rhs.handle_ = NULL;
+    cache_ = rhs.cache_;
+    rhs.cache_ = NULL;
+    cache_key_ = rhs.cache_key_;
     return *this;
   }
 
   int CopyBufferHandle(buffer_handle_t handle, const gralloc_module_t *gralloc);
+  int CopyBufferHandle(buffer_handle_t handle, DrmHwcNativeHandleCache *cache);
 
   void Clear();
 
@@ -114,6 +137,61 @@ class DrmHwcNativeHandle {
  private:
   const gralloc_module_t *gralloc_ = NULL;
   native_handle_t *handle_ = NULL;
+
+  // Set if handle_ is owned by a DrmHwcNativeHandleCache
+  DrmHwcNativeHandleCache *cache_ = NULL;
+  uint64_t cache_key_ = 0;
+};
+
+// Keeps a duplicated, gralloc-registered copy of buffer handles around for as
+// long as they are referenced, plus a few unreferenced ones so that buffers
+// recycled through a BufferQueue aren't registered again on every frame.
+// Buffers are told apart using Importer::GetBufferId, plus the ints of the
+// handle in case the id gets reused for a buffer with different metadata.
+class DrmHwcNativeHandleCache {
+ public:
+  DrmHwcNativeHandleCache(const gralloc_module_t *gralloc, Importer *importer);
+  DrmHwcNativeHandleCache(const DrmHwcNativeHandleCache &) = delete;
+  ~DrmHwcNativeHandleCache();
+
+  // Returns the cached copy of handle in *handle_copy and the key to release
+  // it with in *key. *key is 0 if the buffer can't be cached, in which case
+  // the caller owns *handle_copy.
+  int Acquire(buffer_handle_t handle, native_handle_t **handle_copy,
+              uint64_t *key);
+  void Release(uint64_t key);
+
+  // Drops the cached copy of handle once it is no longer referenced
+  void ReleaseCachedBuffer(buffer_handle_t handle);
+
+  const gralloc_module_t *gralloc() const {
+    return gralloc_;
+  }
+
+ private:
+  static const unsigned kMaxIdleHandles = 16;
+
+  struct Entry {
+    native_handle_t *handle = NULL;
+    // The ints of the handle as SurfaceFlinger passed it in, registerBuffer
+    // may change the ones of our copy
+    std::vector<int> ints;
+    unsigned refs = 0;
+    uint64_t last_release = 0;
+    bool evict = false;
+  };
+
+  static bool SameInts(const Entry &entry, buffer_handle_t handle);
+  void FreeEntry(std::map<uint64_t, Entry>::iterator entry);
+  void EvictIdleHandles();
+
+  const gralloc_module_t *gralloc_;
+  Importer *importer_;
+
+  pthread_mutex_t lock_;
+  std::map<uint64_t, Entry> handles_;
+  unsigned idle_handles_ = 0;
+  uint64_t release_count_ = 0;
 };
 
 template <typename T>
@@ -144,6 +222,12 @@ struct DrmHwcLayer {
   uint8_t alpha = 0xff;
   DrmHwcRect<float> source_crop;
   DrmHwcRect<int> display_frame;
+  // Set for cursor layers, which may be placed on a cursor plane
+  bool cursor = false;
+  // Set for layers without a buffer which fill display_frame with color.
+  // No plane can scan them out, so they're always precomposited.
+  bool solid_color = false;
+  hwc_color_t color = {0, 0, 0, 0};
 
   UniqueFd acquire_fence;
   OutputFd release_fence;
@@ -151,6 +235,7 @@ struct DrmHwcLayer {
   int InitFromHwcLayer(hwc_layer_1_t *sf_layer, Importer *importer,
                        const gralloc_module_t *gralloc);
   int ImportBuffer(Importer *importer, const gralloc_module_t *gralloc);
+  int ImportBuffer(Importer *importer, DrmHwcNativeHandleCache *handle_cache);
 
   void SetTransform(int32_t sf_transform);
   void SetSourceCrop(hwc_frect_t const &crop);
@@ -24,6 +24,9 @@
 #include "vsyncworker.h"
 
 #include <inttypes.h>
+#include <string.h>
+#include <algorithm>
+#include <sstream>
 #include <string>
 
 #include <log/log.h>
@@ -77,25 +80,55 @@ HWC2::Error DrmHwcTwo::Init() {
     return HWC2::Error::NoResources;
   }
 
-  displays_.emplace(std::piecewise_construct,
-                    std::forward_as_tuple(HWC_DISPLAY_PRIMARY),
-                    std::forward_as_tuple(&drm_, importer_, gralloc_,
-                                          HWC_DISPLAY_PRIMARY,
-                                          HWC2::DisplayType::Physical));
+  handle_cache_.reset(new DrmHwcNativeHandleCache(gralloc_, importer_.get()));
 
-  DrmCrtc *crtc = drm_.GetCrtcForDisplay(static_cast<int>(HWC_DISPLAY_PRIMARY));
-  if (!crtc) {
-    ALOGE("Failed to get crtc for display %d",
-          static_cast<int>(HWC_DISPLAY_PRIMARY));
-    return HWC2::Error::BadDisplay;
+  ret = plane_arbiter_.Init(&drm_);
+  if (ret) {
+    ALOGE("Failed to initialize the plane arbiter %d", ret);
+    return HWC2::Error::NoResources;
   }
 
-  std::vector<DrmPlane *> display_planes;
-  for (auto &plane : drm_.planes()) {
-    if (plane->GetCrtcSupported(*crtc))
-      display_planes.push_back(plane.get());
+  // The primary display is always there, other displays only if something is
+  // plugged in at boot
+  for (auto &conn : drm_.connectors()) {
+    int display = conn->display();
+    if (display != HWC_DISPLAY_PRIMARY &&
+        conn->state() != DRM_MODE_CONNECTED)
+      continue;
+
+    DrmCrtc *crtc = drm_.GetCrtcForDisplay(display);
+    if (!crtc) {
+      ALOGE("Failed to get crtc for display %d", display);
+      if (display == HWC_DISPLAY_PRIMARY)
+        return HWC2::Error::BadDisplay;
+      continue;
+    }
+
+    hwc2_display_t handle = static_cast<hwc2_display_t>(display);
+    displays_.emplace(std::piecewise_construct, std::forward_as_tuple(handle),
+                      std::forward_as_tuple(&drm_, importer_, gralloc_,
+                                            handle_cache_, handle,
+                                            HWC2::DisplayType::Physical));
+
+    std::vector<DrmPlane *> display_planes;
+    for (auto &plane : drm_.planes()) {
+      if (plane->GetCrtcSupported(*crtc))
+        display_planes.push_back(plane.get());
+    }
+    HWC2::Error err =
+        displays_.at(handle).Init(&display_planes, &plane_arbiter_);
+    if (err != HWC2::Error::None && display != HWC_DISPLAY_PRIMARY) {
+      ALOGE("Failed to initialize display %d", display);
+      displays_.erase(handle);
+      continue;
+    }
+
+    ret = plane_arbiter_.AddDisplay(display, crtc);
+    if (ret) {
+      ALOGE("Failed to add display %d to the plane arbiter %d", display, ret);
+      return HWC2::Error::NoResources;
+    }
   }
-  displays_.at(HWC_DISPLAY_PRIMARY).Init(&display_planes);
   return HWC2::Error::None;
 }
 
@@ -122,8 +155,23 @@ HWC2::Error DrmHwcTwo::DestroyVirtualDisplay(hwc2_display_t display) {
 }
 
 void DrmHwcTwo::Dump(uint32_t *size, char *buffer) {
-  // TODO: Implement dump
-  unsupported(__func__, size, buffer);
+  supported(__func__);
+
+  // surfaceflinger asks for the size first, then for the contents
+  if (!buffer) {
+    std::ostringstream out;
+    drm_.buffer_reaper()->Dump(&out);
+    drm_.commit_merger()->Dump(&out);
+    plane_arbiter_.Dump(&out);
+    for (auto &display : displays_)
+      display.second.Dump(&out);
+    dump_string_ = out.str();
+    *size = dump_string_.size();
+    return;
+  }
+
+  *size = std::min<uint32_t>(*size, dump_string_.size());
+  memcpy(buffer, dump_string_.data(), *size);
 }
 
 uint32_t DrmHwcTwo::GetMaxVirtualDisplayCount() {
@@ -142,8 +190,10 @@ HWC2::Error DrmHwcTwo::RegisterCallback(int32_t descriptor,
   switch (callback) {
     case HWC2::Callback::Hotplug: {
       auto hotplug = reinterpret_cast<HWC2_PFN_HOTPLUG>(function);
-      hotplug(data, HWC_DISPLAY_PRIMARY,
-              static_cast<int32_t>(HWC2::Connection::Connected));
+      for (std::pair<const hwc2_display_t, DrmHwcTwo::HwcDisplay> &d :
+           displays_)
+        hotplug(data, d.first,
+                static_cast<int32_t>(HWC2::Connection::Connected));
       break;
     }
     case HWC2::Callback::Vsync: {
@@ -152,6 +202,12 @@ HWC2::Error DrmHwcTwo::RegisterCallback(int32_t descriptor,
         d.second.RegisterVsyncCallback(data, function);
       break;
     }
+    case HWC2::Callback::Refresh: {
+      for (std::pair<const hwc2_display_t, DrmHwcTwo::HwcDisplay> &d :
+           displays_)
+        d.second.RegisterRefreshCallback(data, function);
+      break;
+    }
     default:
       break;
   }
@@ -161,16 +217,20 @@ HWC2::Error DrmHwcTwo::RegisterCallback(int32_t descriptor,
 DrmHwcTwo::HwcDisplay::HwcDisplay(DrmResources *drm,
                                   std::shared_ptr<Importer> importer,
                                   const gralloc_module_t *gralloc,
+                                  std::shared_ptr<DrmHwcNativeHandleCache>
+                                      handle_cache,
                                   hwc2_display_t handle, HWC2::DisplayType type)
     : drm_(drm),
       importer_(importer),
       gralloc_(gralloc),
+      handle_cache_(handle_cache),
       handle_(handle),
       type_(type) {
   supported(__func__);
 }
 
-HWC2::Error DrmHwcTwo::HwcDisplay::Init(std::vector<DrmPlane *> *planes) {
+HWC2::Error DrmHwcTwo::HwcDisplay::Init(std::vector<DrmPlane *> *planes,
+                                        PlaneArbiter *plane_arbiter) {
   supported(__func__);
   planner_ = Planner::CreateInstance(drm_);
   if (!planner_) {
@@ -185,16 +245,21 @@ HWC2::Error DrmHwcTwo::HwcDisplay::Init(std::vector<DrmPlane *> *planes) {
     return HWC2::Error::NoResources;
   }
 
-  // Split up the given display planes into primary and overlay to properly
-  // interface with the composition
+  // Split up the given display planes into primary and cursor to properly
+  // interface with the composition. Overlays are handed out frame by frame
+  // by the plane arbiter, since other displays may want them as well.
   char use_overlay_planes_prop[PROPERTY_VALUE_MAX];
   property_get("hwc.drm.use_overlay_planes", use_overlay_planes_prop, "1");
-  bool use_overlay_planes = atoi(use_overlay_planes_prop);
+  use_overlay_planes_ = atoi(use_overlay_planes_prop);
+  plane_arbiter_ = plane_arbiter;
+  char use_cursor_planes_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.use_cursor_planes", use_cursor_planes_prop, "1");
+  bool use_cursor_planes = atoi(use_cursor_planes_prop);
   for (auto &plane : *planes) {
     if (plane->type() == DRM_PLANE_TYPE_PRIMARY)
       primary_planes_.push_back(plane);
-    else if (use_overlay_planes && (plane)->type() == DRM_PLANE_TYPE_OVERLAY)
-      overlay_planes_.push_back(plane);
+    else if (use_cursor_planes && plane->type() == DRM_PLANE_TYPE_CURSOR)
+      cursor_planes_.push_back(plane);
   }
 
   crtc_ = drm_->GetCrtcForDisplay(display);
@@ -229,6 +294,21 @@ HWC2::Error DrmHwcTwo::HwcDisplay::Init(std::vector<DrmPlane *> *planes) {
     return HWC2::Error::BadDisplay;
   }
 
+  ret = import_worker_.Init(importer_.get(), handle_cache_.get());
+  if (ret) {
+    ALOGE("Failed to create import worker for d=%d %d\n", display, ret);
+    return HWC2::Error::BadDisplay;
+  }
+  client_layer_.set_import_worker(&import_worker_);
+
+  ret = compositor_worker_.Init(&compositor_, plane_arbiter_, display);
+  if (ret) {
+    ALOGE("Failed to create compositor worker for d=%d %d\n", display, ret);
+    return HWC2::Error::BadDisplay;
+  }
+  drm_->commit_merger()->SetDisplayThreaded(display,
+                                            compositor_worker_.initialized());
+
   return SetActiveConfig(default_config);
 }
 
@@ -240,6 +320,18 @@ HWC2::Error DrmHwcTwo::HwcDisplay::RegisterVsyncCallback(
   return HWC2::Error::None;
 }
 
+void DrmHwcTwo::HwcDisplay::RegisterRefreshCallback(
+    hwc2_callback_data_t data, hwc2_function_pointer_t func) {
+  supported(__func__);
+  refresh_data_ = data;
+  refresh_callback_ = reinterpret_cast<HWC2_PFN_REFRESH>(func);
+}
+
+void DrmHwcTwo::HwcDisplay::Dump(std::ostringstream *out) {
+  compositor_.Dump(out);
+  compositor_worker_.Dump(out);
+}
+
 HWC2::Error DrmHwcTwo::HwcDisplay::AcceptDisplayChanges() {
   supported(__func__);
   for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_)
@@ -250,6 +342,7 @@ HWC2::Error DrmHwcTwo::HwcDisplay::AcceptDisplayChanges() {
 HWC2::Error DrmHwcTwo::HwcDisplay::CreateLayer(hwc2_layer_t *layer) {
   supported(__func__);
   layers_.emplace(static_cast<hwc2_layer_t>(layer_idx_), HwcLayer());
+  layers_.at(layer_idx_).set_import_worker(&import_worker_);
   *layer = static_cast<hwc2_layer_t>(layer_idx_);
   ++layer_idx_;
   return HWC2::Error::None;
@@ -257,7 +350,18 @@ HWC2::Error DrmHwcTwo::HwcDisplay::CreateLayer(hwc2_layer_t *layer) {
 
 HWC2::Error DrmHwcTwo::HwcDisplay::DestroyLayer(hwc2_layer_t layer) {
   supported(__func__);
-  layers_.erase(layer);
+  auto it = layers_.find(layer);
+  if (it == layers_.end())
+    return HWC2::Error::BadLayer;
+
+  // Don't hold on to the layer's buffer import past the lifetime of the layer,
+  // the worker may still be importing it
+  it->second.cancel_import();
+  if (it->second.buffer()) {
+    importer_->ReleaseCachedBuffer(it->second.buffer());
+    handle_cache_->ReleaseCachedBuffer(it->second.buffer());
+  }
+  layers_.erase(it);
   return HWC2::Error::None;
 }
 
@@ -496,6 +600,8 @@ HWC2::Error DrmHwcTwo::HwcDisplay::PresentDisplay(int32_t *retire_fence) {
   for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
     switch (l.second.validated_type()) {
       case HWC2::Composition::Device:
+      case HWC2::Composition::Cursor:
+      case HWC2::Composition::SolidColor:
         z_map.emplace(std::make_pair(l.second.z_order(), &l.second));
         break;
       case HWC2::Composition::Client:
@@ -514,7 +620,9 @@ HWC2::Error DrmHwcTwo::HwcDisplay::PresentDisplay(int32_t *retire_fence) {
   for (std::pair<const uint32_t, DrmHwcTwo::HwcLayer *> &l : z_map) {
     DrmHwcLayer layer;
     l.second->PopulateDrmLayer(&layer);
-    int ret = layer.ImportBuffer(importer_.get(), gralloc_);
+    layer.cursor = l.second->validated_type() == HWC2::Composition::Cursor;
+    int ret = l.second->ImportBuffer(&layer, importer_.get(),
+                                     handle_cache_.get());
     if (ret) {
       ALOGE("Failed to import layer, ret=%d", ret);
       return HWC2::Error::NoResources;
@@ -537,8 +645,26 @@ HWC2::Error DrmHwcTwo::HwcDisplay::PresentDisplay(int32_t *retire_fence) {
     return HWC2::Error::BadLayer;
   }
 
+  // Every layer that can't go on the primary or a cursor plane wants an
+  // overlay
+  size_t overlay_demand = 0;
+  for (DrmHwcLayer &layer : map.layers) {
+    if (!layer.cursor || cursor_planes_.empty())
+      ++overlay_demand;
+  }
+  overlay_demand -= std::min(overlay_demand, primary_planes_.size());
+
   std::vector<DrmPlane *> primary_planes(primary_planes_);
-  std::vector<DrmPlane *> overlay_planes(overlay_planes_);
+  std::vector<DrmPlane *> overlay_planes;
+  std::vector<DrmPlane *> released_planes;
+  if (use_overlay_planes_)
+    plane_arbiter_->AcquirePlanes(static_cast<int>(handle_), frame_no_,
+                                  overlay_demand, &overlay_planes,
+                                  &released_planes);
+  // Cursor planes are handed to the planner with the overlays, which only
+  // uses them for cursor layers
+  overlay_planes.insert(overlay_planes.end(), cursor_planes_.begin(),
+                        cursor_planes_.end());
   ret = composition->Plan(compositor_.squash_state(), &primary_planes,
                          &overlay_planes);
   if (ret) {
@@ -555,10 +681,21 @@ HWC2::Error DrmHwcTwo::HwcDisplay::PresentDisplay(int32_t *retire_fence) {
     composition->AddPlaneDisable(*i);
     i = overlay_planes.erase(i);
   }
+  // Planes given back to the arbiter must be off before another display can
+  // take them
+  for (DrmPlane *plane : released_planes)
+    composition->AddPlaneRelease(plane);
+
+  // Planning created the release fences, hand them to the layers now since
+  // the frame may still be queued once we return
+  for (DrmHwcLayer &layer : composition->layers())
+    layer.release_fence = OutputFd();
+  for (std::pair<const uint32_t, DrmHwcTwo::HwcLayer *> &l : z_map)
+    l.second->manage_release_fence();
 
   AddFenceToRetireFence(composition->take_out_fence());
 
-  ret = compositor_.ApplyComposition(std::move(composition));
+  ret = compositor_worker_.QueueComposition(std::move(composition));
   if (ret) {
     ALOGE("Failed to apply the frame composition ret=%d", ret);
     return HWC2::Error::BadParameter;
@@ -587,7 +724,7 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetActiveConfig(hwc2_config_t config) {
       compositor_.CreateComposition();
   composition->Init(drm_, crtc_, importer_.get(), planner_.get(), frame_no_);
   int ret = composition->SetDisplayMode(*mode);
-  ret = compositor_.ApplyComposition(std::move(composition));
+  ret = compositor_worker_.ApplyComposition(std::move(composition));
   if (ret) {
     ALOGE("Failed to queue dpms composition on %d", ret);
     return HWC2::Error::BadConfig;
@@ -667,11 +804,15 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetPowerMode(int32_t mode_in) {
       compositor_.CreateComposition();
   composition->Init(drm_, crtc_, importer_.get(), planner_.get(), frame_no_);
   composition->SetDpmsMode(dpms_value);
-  int ret = compositor_.ApplyComposition(std::move(composition));
+  int ret = compositor_worker_.ApplyComposition(std::move(composition));
   if (ret) {
     ALOGE("Failed to apply the dpms composition ret=%d", ret);
     return HWC2::Error::BadParameter;
   }
+  // The compositor disabled all of the display's planes before turning it off,
+  // so other displays may take them
+  if (mode == HWC2::PowerMode::Off)
+    plane_arbiter_->ReleaseAll(static_cast<int>(handle_));
   return HWC2::Error::None;
 }
 
@@ -689,8 +830,24 @@ HWC2::Error DrmHwcTwo::HwcDisplay::ValidateDisplay(uint32_t *num_types,
   for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
     DrmHwcTwo::HwcLayer &layer = l.second;
     switch (layer.sf_type()) {
-      case HWC2::Composition::SolidColor:
       case HWC2::Composition::Cursor:
+        // Cursor layers that miss the cursor plane get precomposited
+        if (!cursor_planes_.empty() && compositor_.uses_GL()) {
+          layer.set_validated_type(layer.sf_type());
+          break;
+        }
+        layer.set_validated_type(HWC2::Composition::Client);
+        ++*num_types;
+        break;
+      case HWC2::Composition::SolidColor:
+        // Solid colors are drawn by the precompositor
+        if (compositor_.uses_GL()) {
+          layer.set_validated_type(layer.sf_type());
+          break;
+        }
+        layer.set_validated_type(HWC2::Composition::Client);
+        ++*num_types;
+        break;
       case HWC2::Composition::Sideband:
         layer.set_validated_type(HWC2::Composition::Client);
         ++*num_types;
@@ -710,10 +867,35 @@ HWC2::Error DrmHwcTwo::HwcDisplay::ValidateDisplay(uint32_t *num_types,
   return *num_types ? HWC2::Error::HasChanges : HWC2::Error::None;
 }
 
+HWC2::Error DrmHwcTwo::HwcDisplay::SetCursorPosition(hwc2_layer_t layer,
+                                                     int32_t x, int32_t y) {
+  supported(__func__);
+  auto l = layers_.find(layer);
+  if (l == layers_.end())
+    return HWC2::Error::BadLayer;
+
+  l->second.SetCursorPosition(x, y);
+  if (l->second.validated_type() != HWC2::Composition::Cursor)
+    return HWC2::Error::None;
+
+  // SurfaceFlinger won't present a frame for cursor moves, so if the cursor
+  // didn't make it onto a cursor plane, ask for one
+  int ret = compositor_worker_.MoveCursor(x, y);
+  if (ret == -ENOENT && refresh_callback_)
+    refresh_callback_(refresh_data_, handle_);
+  else if (ret)
+    return HWC2::Error::BadLayer;
+  return HWC2::Error::None;
+}
+
 HWC2::Error DrmHwcTwo::HwcLayer::SetCursorPosition(int32_t x, int32_t y) {
   supported(__func__);
   cursor_x_ = x;
   cursor_y_ = y;
+  display_frame_.right += x - display_frame_.left;
+  display_frame_.bottom += y - display_frame_.top;
+  display_frame_.left = x;
+  display_frame_.top = y;
   return HWC2::Error::None;
 }
 
@@ -740,8 +922,9 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerBuffer(buffer_handle_t buffer,
 }
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerColor(hwc_color_t color) {
-  // TODO: Punt to client composition here?
-  return unsupported(__func__, color);
+  supported(__func__);
+  color_ = color;
+  return HWC2::Error::None;
 }
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerCompositionType(int32_t type) {
@@ -806,6 +989,20 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerZOrder(uint32_t order) {
   return HWC2::Error::None;
 }
 
+int DrmHwcTwo::HwcLayer::ImportBuffer(DrmHwcLayer *layer, Importer *importer,
+                                      DrmHwcNativeHandleCache *handle_cache) {
+  if (layer->solid_color)
+    return 0;
+
+  // Pick up the import started in set_buffer, if it's still for our buffer
+  std::shared_ptr<DrmHwcPendingImport> import = std::move(pending_import_);
+  if (import && import->handle == buffer_ &&
+      !import_worker_->CollectImport(import, layer))
+    return 0;
+
+  return layer->ImportBuffer(importer, handle_cache);
+}
+
 void DrmHwcTwo::HwcLayer::PopulateDrmLayer(DrmHwcLayer *layer) {
   supported(__func__);
   switch (blending_) {
@@ -833,6 +1030,16 @@ void DrmHwcTwo::HwcLayer::PopulateDrmLayer(DrmHwcLayer *layer) {
   layer->alpha = static_cast<uint8_t>(255.0f * alpha_ + 0.5f);
   layer->SetSourceCrop(source_crop_);
   layer->SetTransform(static_cast<int32_t>(transform_));
+
+  if (validated_type_ == HWC2::Composition::SolidColor) {
+    layer->solid_color = true;
+    layer->color = color_;
+    // There's nothing to crop, so keep the layer from looking scaled
+    layer->source_crop = DrmHwcRect<float>(0.0f, 0.0f,
+                                           layer->display_frame.width(),
+                                           layer->display_frame.height());
+    layer->transform = 0;
+  }
 }
 
 // static
@@ -985,8 +1192,9 @@ hwc2_function_pointer_t DrmHwcTwo::HookDevGetFunction(
     // Layer functions
     case HWC2::FunctionDescriptor::SetCursorPosition:
       return ToHook<HWC2_PFN_SET_CURSOR_POSITION>(
-          LayerHook<decltype(&HwcLayer::SetCursorPosition),
-                    &HwcLayer::SetCursorPosition, int32_t, int32_t>);
+          DisplayHook<decltype(&HwcDisplay::SetCursorPosition),
+                      &HwcDisplay::SetCursorPosition, hwc2_layer_t, int32_t,
+                      int32_t>);
     case HWC2::FunctionDescriptor::SetLayerBlendMode:
       return ToHook<HWC2_PFN_SET_LAYER_BLEND_MODE>(
           LayerHook<decltype(&HwcLayer::SetLayerBlendMode),
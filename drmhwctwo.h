@@ -14,15 +14,20 @@
  * limitations under the License.
  */
 
+#include "drmcompositorworker.h"
 #include "drmdisplaycompositor.h"
 #include "drmhwcomposer.h"
 #include "drmresources.h"
+#include "importworker.h"
+#include "planearbiter.h"
 #include "platform.h"
 #include "vsyncworker.h"
 
 #include <hardware/hwcomposer2.h>
 
 #include <map>
+#include <sstream>
+#include <string>
 
 namespace android {
 
@@ -63,6 +68,17 @@ class DrmHwcTwo : public hwc2_device_t {
     }
     void set_buffer(buffer_handle_t buffer) {
       buffer_ = buffer;
+      cancel_import();
+      if (import_worker_ && buffer)
+        pending_import_ = import_worker_->QueueImport(buffer);
+    }
+    void set_import_worker(ImportWorker *import_worker) {
+      import_worker_ = import_worker;
+    }
+    void cancel_import() {
+      if (pending_import_)
+        import_worker_->CancelImport(pending_import_);
+      pending_import_.reset();
     }
 
     int take_acquire_fence() {
@@ -87,6 +103,8 @@ class DrmHwcTwo : public hwc2_device_t {
     }
 
     void PopulateDrmLayer(DrmHwcLayer *layer);
+    int ImportBuffer(DrmHwcLayer *layer, Importer *importer,
+                     DrmHwcNativeHandleCache *handle_cache);
 
     // Layer hooks
     HWC2::Error SetCursorPosition(int32_t x, int32_t y);
@@ -111,7 +129,7 @@ class DrmHwcTwo : public hwc2_device_t {
     HWC2::Composition validated_type_ = HWC2::Composition::Invalid;
 
     HWC2::BlendMode blending_ = HWC2::BlendMode::None;
-    buffer_handle_t buffer_;
+    buffer_handle_t buffer_ = NULL;
     UniqueFd acquire_fence_;
     int release_fence_raw_ = -1;
     UniqueFd release_fence_;
@@ -121,8 +139,12 @@ class DrmHwcTwo : public hwc2_device_t {
     int32_t cursor_x_;
     int32_t cursor_y_;
     HWC2::Transform transform_ = HWC2::Transform::None;
+    hwc_color_t color_ = {0, 0, 0, 0};
     uint32_t z_order_ = 0;
     android_dataspace_t dataspace_ = HAL_DATASPACE_UNKNOWN;
+
+    ImportWorker *import_worker_ = NULL;
+    std::shared_ptr<DrmHwcPendingImport> pending_import_;
   };
 
   struct HwcCallback {
@@ -136,13 +158,18 @@ class DrmHwcTwo : public hwc2_device_t {
   class HwcDisplay {
    public:
     HwcDisplay(DrmResources *drm, std::shared_ptr<Importer> importer,
-               const gralloc_module_t *gralloc, hwc2_display_t handle,
-               HWC2::DisplayType type);
+               const gralloc_module_t *gralloc,
+               std::shared_ptr<DrmHwcNativeHandleCache> handle_cache,
+               hwc2_display_t handle, HWC2::DisplayType type);
     HwcDisplay(const HwcDisplay &) = delete;
-    HWC2::Error Init(std::vector<DrmPlane *> *planes);
+    HWC2::Error Init(std::vector<DrmPlane *> *planes,
+                     PlaneArbiter *plane_arbiter);
 
     HWC2::Error RegisterVsyncCallback(hwc2_callback_data_t data,
                                       hwc2_function_pointer_t func);
+    void RegisterRefreshCallback(hwc2_callback_data_t data,
+                                 hwc2_function_pointer_t func);
+    void Dump(std::ostringstream *out);
 
     // HWC Hooks
     HWC2::Error AcceptDisplayChanges();
@@ -172,6 +199,7 @@ class DrmHwcTwo : public hwc2_device_t {
     HWC2::Error GetReleaseFences(uint32_t *num_elements, hwc2_layer_t *layers,
                                  int32_t *fences);
     HWC2::Error PresentDisplay(int32_t *retire_fence);
+    HWC2::Error SetCursorPosition(hwc2_layer_t layer, int32_t x, int32_t y);
     HWC2::Error SetActiveConfig(hwc2_config_t config);
     HWC2::Error SetClientTarget(buffer_handle_t target, int32_t acquire_fence,
                                 int32_t dataspace, hwc_region_t damage);
@@ -193,11 +221,18 @@ class DrmHwcTwo : public hwc2_device_t {
     std::shared_ptr<Importer> importer_;
     std::unique_ptr<Planner> planner_;
     const gralloc_module_t *gralloc_;
+    std::shared_ptr<DrmHwcNativeHandleCache> handle_cache_;
+    // Applies the frames planned by PresentDisplay to compositor_
+    DrmCompositorWorker compositor_worker_;
 
     std::vector<DrmPlane *> primary_planes_;
-    std::vector<DrmPlane *> overlay_planes_;
+    std::vector<DrmPlane *> cursor_planes_;
+    // Hands out the overlay planes, which may be shared with other displays
+    PlaneArbiter *plane_arbiter_ = NULL;
+    bool use_overlay_planes_ = true;
 
     VSyncWorker vsync_worker_;
+    ImportWorker import_worker_;
     DrmConnector *connector_ = NULL;
     DrmCrtc *crtc_ = NULL;
     hwc2_display_t handle_;
@@ -208,6 +243,8 @@ class DrmHwcTwo : public hwc2_device_t {
     UniqueFd retire_fence_;
     UniqueFd next_retire_fence_;
     int32_t color_mode_;
+    hwc2_callback_data_t refresh_data_ = NULL;
+    HWC2_PFN_REFRESH refresh_callback_ = NULL;
 
     uint32_t frame_no_ = 0;
   };
@@ -265,7 +302,11 @@ class DrmHwcTwo : public hwc2_device_t {
   DrmResources drm_;
   std::shared_ptr<Importer> importer_;  // Shared with HwcDisplay
   const gralloc_module_t *gralloc_;
+  // Shared with HwcDisplay
+  std::shared_ptr<DrmHwcNativeHandleCache> handle_cache_;
+  PlaneArbiter plane_arbiter_;
   std::map<hwc2_display_t, HwcDisplay> displays_;
   std::map<HWC2::Callback, HwcCallback> callbacks_;
+  std::string dump_string_;
 };
 }
@@ -16,20 +16,26 @@
 
 #define LOG_TAG "hwc-drm-plane"
 
+#include "drmhwcomposer.h"
 #include "drmplane.h"
 #include "drmresources.h"
 
+#include <algorithm>
 #include <cinttypes>
 #include <errno.h>
 #include <stdint.h>
 
+#include <drm/drm_fourcc.h>
 #include <log/log.h>
 #include <xf86drmMode.h>
 
 namespace android {
 
 DrmPlane::DrmPlane(DrmResources *drm, drmModePlanePtr p)
-    : drm_(drm), id_(p->plane_id), possible_crtc_mask_(p->possible_crtcs) {
+    : drm_(drm),
+      id_(p->plane_id),
+      possible_crtc_mask_(p->possible_crtcs),
+      formats_(p->formats, p->formats + p->count_formats) {
 }
 
 int DrmPlane::Init() {
@@ -130,6 +136,74 @@ int DrmPlane::Init() {
   if (ret)
     ALOGI("Could not get IN_FENCE_FD property");
 
+  ret = drm_->GetPlaneProperty(*this, "zpos", &zpos_property_);
+  if (ret) {
+    ALOGI("Could not get zpos property");
+  } else if (zpos_property_.is_immutable()) {
+    zpos_property_.value(&zpos_min_);
+    zpos_max_ = zpos_min_;
+  } else if (zpos_property_.range(&zpos_min_, &zpos_max_)) {
+    ALOGE("Failed to get zpos range for plane %d", id_);
+  }
+
+  DrmProperty in_formats;
+  ret = drm_->GetPlaneProperty(*this, "IN_FORMATS", &in_formats);
+  if (ret)
+    ALOGI("Could not get IN_FORMATS property");
+  else if (ParseInFormats(in_formats))
+    ALOGE("Failed to parse IN_FORMATS for plane %d", id_);
+
+  return 0;
+}
+
+int DrmPlane::ParseInFormats(const DrmProperty &in_formats) {
+  uint64_t blob_id;
+  int ret = in_formats.value(&blob_id);
+  if (ret)
+    return ret;
+
+  drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(drm_->fd(), blob_id);
+  if (!blob)
+    return -ENOENT;
+
+  const uint8_t *data = static_cast<const uint8_t *>(blob->data);
+  const struct drm_format_modifier_blob *header =
+      reinterpret_cast<const struct drm_format_modifier_blob *>(data);
+  if (blob->length < sizeof(*header) ||
+      header->version != FORMAT_BLOB_CURRENT) {
+    drmModeFreePropertyBlob(blob);
+    return -EINVAL;
+  }
+
+  // Don't trust the kernel's offsets and counts to stay inside the blob
+  uint64_t formats_end = (uint64_t)header->formats_offset +
+                         (uint64_t)header->count_formats * sizeof(uint32_t);
+  uint64_t modifiers_end =
+      (uint64_t)header->modifiers_offset +
+      (uint64_t)header->count_modifiers * sizeof(struct drm_format_modifier);
+  if (formats_end > blob->length || modifiers_end > blob->length) {
+    drmModeFreePropertyBlob(blob);
+    return -EINVAL;
+  }
+
+  const uint32_t *formats =
+      reinterpret_cast<const uint32_t *>(data + header->formats_offset);
+  const struct drm_format_modifier *modifiers =
+      reinterpret_cast<const struct drm_format_modifier *>(
+          data + header->modifiers_offset);
+  for (uint32_t i = 0; i < header->count_modifiers; i++) {
+    // Each modifier applies to up to 64 formats, starting at offset
+    for (uint32_t j = 0; j < 64; j++) {
+      uint32_t format_index = modifiers[i].offset + j;
+      if (!(modifiers[i].formats & (1ULL << j)) ||
+          format_index >= header->count_formats)
+        continue;
+      format_modifiers_.emplace_back(formats[format_index],
+                                     modifiers[i].modifier);
+    }
+  }
+
+  drmModeFreePropertyBlob(blob);
   return 0;
 }
 
@@ -145,6 +219,65 @@ uint32_t DrmPlane::type() const {
   return type_;
 }
 
+bool DrmPlane::SupportsFormat(uint32_t format) const {
+  return std::find(formats_.begin(), formats_.end(), format) != formats_.end();
+}
+
+bool DrmPlane::IsValidForLayer(DrmHwcLayer *layer) const {
+  if (layer->solid_color || !SupportsScaling(layer))
+    return false;
+
+  if (!layer->buffer)
+    return true;
+
+  const hwc_drm_bo_t *bo = layer->buffer.operator->();
+  return SupportsFormat(bo->format) &&
+         SupportsModifier(bo->format, bo->modifiers[0]);
+}
+
+bool DrmPlane::SupportsScaling(const DrmHwcLayer *layer) const {
+  float src_w = layer->source_crop.width();
+  float src_h = layer->source_crop.height();
+  if (layer->transform & DrmHwcTransform::kRotate90)
+    std::swap(src_w, src_h);
+  float dst_w = layer->display_frame.width();
+  float dst_h = layer->display_frame.height();
+  if (src_w <= 0 || src_h <= 0 || dst_w <= 0 || dst_h <= 0)
+    return true;
+
+  const DrmPlaneScalingLimits &limits = scaling_limits_;
+  if (src_w < limits.min_src_width || src_h < limits.min_src_height)
+    return false;
+  if (limits.max_upscale && (dst_w > src_w * limits.max_upscale ||
+                             dst_h > src_h * limits.max_upscale))
+    return false;
+  if (limits.max_downscale && (src_w > dst_w * limits.max_downscale ||
+                               src_h > dst_h * limits.max_downscale))
+    return false;
+  return true;
+}
+
+bool DrmPlane::SupportsModifier(uint32_t format, uint64_t modifier) const {
+  if (format_modifiers_.empty())
+    return modifier == DRM_FORMAT_MOD_LINEAR ||
+           modifier == DRM_FORMAT_MOD_INVALID;
+
+  if (modifier == DRM_FORMAT_MOD_INVALID)
+    modifier = DRM_FORMAT_MOD_LINEAR;
+  for (const auto &fm : format_modifiers_)
+    if (fm.first == format && fm.second == modifier)
+      return true;
+  return false;
+}
+
+std::vector<uint64_t> DrmPlane::GetFormatModifiers(uint32_t format) const {
+  std::vector<uint64_t> modifiers;
+  for (const auto &fm : format_modifiers_)
+    if (fm.first == format)
+      modifiers.push_back(fm.second);
+  return modifiers;
+}
+
 const DrmProperty &DrmPlane::crtc_property() const {
   return crtc_property_;
 }
@@ -196,4 +329,8 @@ const DrmProperty &DrmPlane::alpha_property() const {
 const DrmProperty &DrmPlane::in_fence_fd_property() const {
   return in_fence_fd_property_;
 }
+
+const DrmProperty &DrmPlane::zpos_property() const {
+  return zpos_property_;
+}
 }
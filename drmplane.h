@@ -27,6 +27,19 @@
 namespace android {
 
 class DrmResources;
+struct DrmHwcLayer;
+
+// What a plane's scaler can do. Scale factors are ratios >= 1 of destination
+// over source size (upscale) or source over destination size (downscale), 0
+// meaning unlimited. Planes sharing a scaler have the same non-zero
+// scaler_group, and only one of them can scale at a time.
+struct DrmPlaneScalingLimits {
+  float max_upscale = 0.0f;
+  float max_downscale = 0.0f;
+  uint32_t min_src_width = 0;
+  uint32_t min_src_height = 0;
+  uint32_t scaler_group = 0;
+};
 
 class DrmPlane {
  public:
@@ -42,6 +55,25 @@ class DrmPlane {
 
   uint32_t type() const;
 
+  bool SupportsFormat(uint32_t format) const;
+  // Checks the format and modifier of the layer's buffer, as well as its
+  // scaling, against the plane
+  bool IsValidForLayer(DrmHwcLayer *layer) const;
+
+  const DrmPlaneScalingLimits &scaling_limits() const {
+    return scaling_limits_;
+  }
+  void set_scaling_limits(const DrmPlaneScalingLimits &limits) {
+    scaling_limits_ = limits;
+  }
+  bool SupportsScaling(const DrmHwcLayer *layer) const;
+
+  // Returns true if the plane can scan out buffers of the given format laid
+  // out with modifier. Planes without an IN_FORMATS property are assumed to
+  // only handle linear buffers.
+  bool SupportsModifier(uint32_t format, uint64_t modifier) const;
+  std::vector<uint64_t> GetFormatModifiers(uint32_t format) const;
+
   const DrmProperty &crtc_property() const;
   const DrmProperty &fb_property() const;
   const DrmProperty &crtc_x_property() const;
@@ -55,8 +87,24 @@ class DrmPlane {
   const DrmProperty &rotation_property() const;
   const DrmProperty &alpha_property() const;
   const DrmProperty &in_fence_fd_property() const;
+  const DrmProperty &zpos_property() const;
+
+  // Planes with a mutable zpos property can be stacked in any order within
+  // [zpos_min, zpos_max]. Otherwise zpos_min == zpos_max is the fixed zpos, if
+  // the driver tells us about it at all.
+  bool has_mutable_zpos() const {
+    return zpos_property_.id() && !zpos_property_.is_immutable();
+  }
+  uint64_t zpos_min() const {
+    return zpos_min_;
+  }
+  uint64_t zpos_max() const {
+    return zpos_max_;
+  }
 
  private:
+  int ParseInFormats(const DrmProperty &in_formats);
+
   DrmResources *drm_;
   uint32_t id_;
 
@@ -64,6 +112,9 @@ class DrmPlane {
 
   uint32_t type_;
 
+  std::vector<uint32_t> formats_;
+  DrmPlaneScalingLimits scaling_limits_;
+
   DrmProperty crtc_property_;
   DrmProperty fb_property_;
   DrmProperty crtc_x_property_;
@@ -77,6 +128,12 @@ class DrmPlane {
   DrmProperty rotation_property_;
   DrmProperty alpha_property_;
   DrmProperty in_fence_fd_property_;
+  DrmProperty zpos_property_;
+  uint64_t zpos_min_ = 0;
+  uint64_t zpos_max_ = 0;
+
+  // (format, modifier) pairs from the IN_FORMATS blob
+  std::vector<std::pair<uint32_t, uint64_t>> format_modifiers_;
 };
 }
 
@@ -99,4 +99,13 @@ int DrmProperty::value(uint64_t *value) const {
       return -EINVAL;
   }
 }
+
+int DrmProperty::range(uint64_t *min, uint64_t *max) const {
+  if (type_ != DRM_PROPERTY_TYPE_INT || values_.size() < 2)
+    return -EINVAL;
+
+  *min = values_[0];
+  *max = values_[1];
+  return 0;
+}
 }
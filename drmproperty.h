@@ -46,6 +46,12 @@ class DrmProperty {
 
   int value(uint64_t *value) const;
 
+  bool is_immutable() const {
+    return id_ && (flags_ & DRM_MODE_PROP_IMMUTABLE);
+  }
+  // Returns the bounds of range properties
+  int range(uint64_t *min, uint64_t *max) const;
+
  private:
   class DrmPropertyEnum {
    public:
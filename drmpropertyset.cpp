@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-drm-property-set"
+
+#include "drmpropertyset.h"
+
+#include <errno.h>
+
+#include <drm/drm_mode.h>
+#include <log/log.h>
+#include <xf86drmMode.h>
+
+namespace android {
+
+DrmPropertySet::DrmPropertySet() {
+}
+
+DrmPropertySet::~DrmPropertySet() {
+  if (pset_)
+    drmModeAtomicFree(pset_);
+}
+
+int DrmPropertySet::Begin() {
+  pending_.clear();
+  request_skipped_ = 0;
+  if (pset_) {
+    drmModeAtomicSetCursor(pset_, 0);
+    return 0;
+  }
+
+  pset_ = drmModeAtomicAlloc();
+  if (!pset_) {
+    ALOGE("Failed to allocate property set");
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+int DrmPropertySet::Add(uint32_t obj_id, uint32_t prop_id, uint64_t value,
+                        bool force) {
+  if (!pset_)
+    return -EINVAL;
+
+  if (!force && IsCommitted(obj_id, prop_id, value)) {
+    ++request_skipped_;
+    return 0;
+  }
+
+  int ret = drmModeAtomicAddProperty(pset_, obj_id, prop_id, value);
+  if (ret < 0)
+    return ret;
+
+  PendingProperty property = {obj_id, prop_id, value};
+  pending_.push_back(property);
+  return 0;
+}
+
+bool DrmPropertySet::IsCommitted(uint32_t obj_id, uint32_t prop_id,
+                                 uint64_t value) const {
+  auto it = committed_.find(std::make_pair(obj_id, prop_id));
+  return it != committed_.end() && it->second == value;
+}
+
+void DrmPropertySet::Forget(uint32_t obj_id) {
+  committed_.erase(committed_.lower_bound(std::make_pair(obj_id, 0u)),
+                   committed_.upper_bound(std::make_pair(obj_id, UINT32_MAX)));
+}
+
+int DrmPropertySet::Commit(int fd, uint32_t flags, void *user_data) {
+  if (!pset_)
+    return -EINVAL;
+
+  int ret = drmModeAtomicCommit(fd, pset_, flags, user_data);
+  if (ret || (flags & DRM_MODE_ATOMIC_TEST_ONLY))
+    return ret;
+
+  Committed();
+  return 0;
+}
+
+void DrmPropertySet::Committed() {
+  ++commits_;
+  sent_properties_ += pending_.size();
+  skipped_properties_ += request_skipped_;
+  for (const PendingProperty &property : pending_)
+    committed_[std::make_pair(property.obj_id, property.prop_id)] =
+        property.value;
+  pending_.clear();
+}
+
+void DrmPropertySet::Dump(std::ostringstream *out) const {
+  *out << "----Property set: commits=" << commits_
+       << " sent=" << sent_properties_ << " skipped=" << skipped_properties_
+       << " tracked=" << committed_.size() << "\n";
+}
+}
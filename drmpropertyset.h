@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_PROPERTY_SET_H_
+#define ANDROID_DRM_PROPERTY_SET_H_
+
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+#include <map>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+namespace android {
+
+// Builds atomic requests which only carry the properties whose values differ
+// from the ones the last successful commit through this set left behind. The
+// request is allocated once and reused for every commit. Everything that
+// commits the objects behind our back has to Forget() them.
+class DrmPropertySet {
+ public:
+  DrmPropertySet();
+  ~DrmPropertySet();
+
+  DrmPropertySet(const DrmPropertySet &) = delete;
+  DrmPropertySet &operator=(const DrmPropertySet &) = delete;
+
+  // Starts a new, empty request
+  int Begin();
+
+  // Adds property prop_id of object obj_id to the request, unless it's already
+  // set to value. force adds it regardless, which is needed for properties
+  // that only apply to a single commit, such as fences.
+  int Add(uint32_t obj_id, uint32_t prop_id, uint64_t value,
+          bool force = false);
+
+  // Returns true if the last commit left obj_id's prop_id at value
+  bool IsCommitted(uint32_t obj_id, uint32_t prop_id, uint64_t value) const;
+
+  // Makes the next requests carry all properties of obj_id which are added
+  void Forget(uint32_t obj_id);
+
+  // Commits the request. Unless it's a test, the values it carried are what
+  // the following requests are compared against once it succeeds.
+  int Commit(int fd, uint32_t flags, void *user_data);
+
+  // For requests committed elsewhere, Committed() has to follow a successful
+  // commit of request()
+  drmModeAtomicReqPtr request() const {
+    return pset_;
+  }
+  void Committed();
+
+  size_t size() const {
+    return pending_.size();
+  }
+
+  void Dump(std::ostringstream *out) const;
+
+ private:
+  struct PendingProperty {
+    uint32_t obj_id;
+    uint32_t prop_id;
+    uint64_t value;
+  };
+
+  drmModeAtomicReqPtr pset_ = NULL;
+  std::vector<PendingProperty> pending_;
+  std::map<std::pair<uint32_t, uint32_t>, uint64_t> committed_;
+  uint64_t request_skipped_ = 0;
+
+  uint64_t commits_ = 0;
+  uint64_t sent_properties_ = 0;
+  uint64_t skipped_properties_ = 0;
+};
+}
+
+#endif  // ANDROID_DRM_PROPERTY_SET_H_
@@ -16,6 +16,7 @@
 
 #define LOG_TAG "hwc-drm-resources"
 
+#include "autolock.h"
 #include "drmconnector.h"
 #include "drmcrtc.h"
 #include "drmencoder.h"
@@ -36,10 +37,14 @@
 namespace android {
 
 DrmResources::DrmResources() : event_listener_(this) {
+  pthread_mutex_init(&gem_lock_, NULL);
 }
 
 DrmResources::~DrmResources() {
   event_listener_.Exit();
+  buffer_reaper_.Exit();
+  buffer_reaper_.Flush();
+  pthread_mutex_destroy(&gem_lock_);
 }
 
 int DrmResources::Init() {
@@ -219,6 +224,18 @@ int DrmResources::Init() {
     return ret;
   }
 
+  ret = buffer_reaper_.Init(this);
+  if (ret) {
+    ALOGE("Can't initialize buffer reaper %d", ret);
+    return ret;
+  }
+
+  ret = commit_merger_.Init(this);
+  if (ret) {
+    ALOGE("Can't initialize commit merger %d", ret);
+    return ret;
+  }
+
   for (auto &conn : connectors_) {
     ret = CreateDisplayPipe(conn.get());
     if (ret) {
@@ -345,10 +362,62 @@ int DrmResources::DestroyPropertyBlob(uint32_t blob_id) {
   return 0;
 }
 
+int DrmResources::ImportGemHandle(int prime_fd, uint32_t *gem_handle) {
+  AutoLock lock(&gem_lock_, "gem");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  ret = drmPrimeFDToHandle(fd(), prime_fd, gem_handle);
+  if (ret) {
+    ALOGE("Failed to import prime fd %d ret=%d", prime_fd, ret);
+    return ret;
+  }
+  ++gem_handle_refs_[*gem_handle];
+  return 0;
+}
+
+int DrmResources::ReleaseGemHandle(uint32_t gem_handle) {
+  if (!gem_handle)
+    return 0;
+
+  AutoLock lock(&gem_lock_, "gem");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  auto refs = gem_handle_refs_.find(gem_handle);
+  if (refs == gem_handle_refs_.end()) {
+    ALOGE("Release of unknown gem handle %" PRIu32, gem_handle);
+    return -EINVAL;
+  }
+  if (--refs->second)
+    return 0;
+  gem_handle_refs_.erase(refs);
+
+  struct drm_gem_close gem_close;
+  memset(&gem_close, 0, sizeof(gem_close));
+  gem_close.handle = gem_handle;
+  ret = drmIoctl(fd(), DRM_IOCTL_GEM_CLOSE, &gem_close);
+  if (ret) {
+    ALOGE("Failed to close gem handle %" PRIu32 " %d", gem_handle, ret);
+    return ret;
+  }
+  return 0;
+}
+
 DrmEventListener *DrmResources::event_listener() {
   return &event_listener_;
 }
 
+BufferReaper *DrmResources::buffer_reaper() {
+  return &buffer_reaper_;
+}
+
+DrmCommitMerger *DrmResources::commit_merger() {
+  return &commit_merger_;
+}
+
 int DrmResources::GetProperty(uint32_t obj_id, uint32_t obj_type,
                               const char *prop_name, DrmProperty *property) {
   drmModeObjectPropertiesPtr props;
@@ -17,14 +17,19 @@
 #ifndef ANDROID_DRM_H_
 #define ANDROID_DRM_H_
 
+#include "bufferreaper.h"
+#include "drmcommitmerger.h"
 #include "drmconnector.h"
 #include "drmcrtc.h"
 #include "drmencoder.h"
 #include "drmeventlistener.h"
 #include "drmplane.h"
 
+#include <pthread.h>
 #include <stdint.h>
 
+#include <map>
+
 namespace android {
 
 class DrmResources {
@@ -58,6 +63,8 @@ class DrmResources {
   DrmCrtc *GetCrtcForDisplay(int display) const;
   DrmPlane *GetPlane(uint32_t id) const;
   DrmEventListener *event_listener();
+  BufferReaper *buffer_reaper();
+  DrmCommitMerger *commit_merger();
 
   int GetPlaneProperty(const DrmPlane &plane, const char *prop_name,
                        DrmProperty *property);
@@ -72,6 +79,12 @@ class DrmResources {
   int CreatePropertyBlob(void *data, size_t length, uint32_t *blob_id);
   int DestroyPropertyBlob(uint32_t blob_id);
 
+  // Imports the dma-buf referred to by prime_fd and returns its gem handle.
+  // The kernel hands out one handle per buffer, so handles are refcounted here
+  // and every successful import must be balanced by a ReleaseGemHandle call.
+  int ImportGemHandle(int prime_fd, uint32_t *gem_handle);
+  int ReleaseGemHandle(uint32_t gem_handle);
+
  private:
   int TryEncoderForDisplay(int display, DrmEncoder *enc);
   int GetProperty(uint32_t obj_id, uint32_t obj_type, const char *prop_name,
@@ -90,6 +103,12 @@ class DrmResources {
 
   std::pair<uint32_t, uint32_t> min_resolution_;
   std::pair<uint32_t, uint32_t> max_resolution_;
+
+  pthread_mutex_t gem_lock_;
+  std::map<uint32_t, unsigned> gem_handle_refs_;
+
+  BufferReaper buffer_reaper_;
+  DrmCommitMerger commit_merger_;
 };
 }
 
@@ -245,6 +245,8 @@ static std::string GenerateFragmentShader(int layer_count) {
   }
   fragment_shader_stream << "uniform float uLayerAlpha[LAYER_COUNT];\n"
                          << "uniform float uLayerPremult[LAYER_COUNT];\n"
+                         << "uniform vec4 uLayerColor[LAYER_COUNT];\n"
+                         << "uniform float uLayerSolid[LAYER_COUNT];\n"
                          << "in vec2 fTexCoords[LAYER_COUNT];\n"
                          << "out vec4 oFragColor;\n"
                          << "void main() {\n"
@@ -257,8 +259,10 @@ static std::string GenerateFragmentShader(int layer_count) {
       fragment_shader_stream << "  if (alphaCover > 0.5/255.0) {\n";
     // clang-format off
     fragment_shader_stream
-        << "  texSample = texture2D(uLayerTexture" << i << ",\n"
-        << "                        fTexCoords[" << i << "]);\n"
+        << "  texSample = mix(texture2D(uLayerTexture" << i << ",\n"
+        << "                            fTexCoords[" << i << "]),\n"
+        << "                  uLayerColor[" << i << "],\n"
+        << "                  uLayerSolid[" << i << "]);\n"
         << "  multRgb = texSample.rgb *\n"
         << "            max(texSample.a, uLayerPremult[" << i << "]);\n"
         << "  color += multRgb * uLayerAlpha[" << i << "] * alphaCover;\n"
@@ -327,6 +331,9 @@ struct RenderingCommand {
     float alpha;
     float premult;
     float texture_matrix[4];
+    // Solid color layers use color in place of a texture sample
+    float solid;
+    float color[4];
   };
 
   float bounds[4];
@@ -346,8 +353,10 @@ static void ConstructCommand(const DrmHwcLayer *layers,
     float display_size[2] = {display_rect.bounds[2] - display_rect.bounds[0],
                              display_rect.bounds[3] - display_rect.bounds[1]};
 
-    float tex_width = layer.buffer->width;
-    float tex_height = layer.buffer->height;
+    // Solid color layers have a source crop of their own size
+    float tex_width = layer.solid_color ? display_size[0] : layer.buffer->width;
+    float tex_height =
+        layer.solid_color ? display_size[1] : layer.buffer->height;
     DrmHwcRect<float> crop_rect(layer.source_crop.left / tex_width,
                                 layer.source_crop.top / tex_height,
                                 layer.source_crop.right / tex_width,
@@ -359,6 +368,14 @@ static void ConstructCommand(const DrmHwcLayer *layers,
     RenderingCommand::TextureSource &src = cmd.textures[cmd.texture_count];
     cmd.texture_count++;
     src.texture_index = texture_index;
+    src.solid = layer.solid_color ? 1.0f : 0.0f;
+    src.color[0] = layer.color.r / 255.0f;
+    src.color[1] = layer.color.g / 255.0f;
+    src.color[2] = layer.color.b / 255.0f;
+    // Without blending the color's alpha is ignored, like a buffer's would be
+    src.color[3] = layer.blending == DrmHwcBlending::kNone
+                       ? 1.0f
+                       : layer.color.a / 255.0f;
 
     bool swap_xy = false;
     bool flip_xy[2] = { false, false };
@@ -415,7 +432,11 @@ static void ConstructCommand(const DrmHwcLayer *layers,
     }
 
     src.alpha = layer.alpha / 255.0f;
-    src.premult = (layer.blending == DrmHwcBlending::kPreMult) ? 1.0f : 0.0f;
+    // Colors aren't premultiplied
+    src.premult = (layer.blending == DrmHwcBlending::kPreMult &&
+                   !layer.solid_color)
+                      ? 1.0f
+                      : 0.0f;
   }
 }
 
@@ -585,12 +606,15 @@ int GLWorkerCompositor::Composite(DrmHwcLayer *layers,
   ATRACE_CALL();
   int ret = 0;
   std::vector<AutoEGLImageAndGLTexture> layer_textures;
+  std::vector<GLuint> layer_texture_ids;
   std::vector<RenderingCommand> commands;
 
   if (num_regions == 0) {
     return -EALREADY;
   }
 
+  composite_count_++;
+
   ret = BeginContext();
   if (ret)
     return -1;
@@ -619,18 +643,21 @@ int GLWorkerCompositor::Composite(DrmHwcLayer *layers,
     DrmHwcLayer *layer = &layers[layer_index];
 
     layer_textures.emplace_back();
+    layer_texture_ids.emplace_back(0);
 
-    if (layers_used_indices.count(layer_index) == 0)
+    if (layers_used_indices.count(layer_index) == 0 || layer->solid_color)
       continue;
 
-    ret = CreateTextureFromHandle(egl_display_, layer->get_usable_handle(),
-                                  importer, &layer_textures.back());
+    layer_texture_ids.back() =
+        PrepareAndCacheLayerTexture(layer, importer, &layer_textures.back());
+    ret = layer_texture_ids.back() ? 0 : -EINVAL;
 
     if (!ret) {
       ret = EGLFenceWait(egl_display_, layer->acquire_fence.Release());
     }
     if (ret) {
       layer_textures.pop_back();
+      layer_texture_ids.pop_back();
       ret = -EINVAL;
     }
   }
@@ -672,6 +699,8 @@ int GLWorkerCompositor::Composite(DrmHwcLayer *layers,
     GLint gl_alpha_loc = glGetUniformLocation(program, "uLayerAlpha");
     GLint gl_premult_loc = glGetUniformLocation(program, "uLayerPremult");
     GLint gl_tex_matrix_loc = glGetUniformLocation(program, "uTexMatrix");
+    GLint gl_color_loc = glGetUniformLocation(program, "uLayerColor");
+    GLint gl_solid_loc = glGetUniformLocation(program, "uLayerSolid");
     glUniform4f(gl_viewport_loc, cmd.bounds[0] / (float)frame_width,
                 cmd.bounds[1] / (float)frame_height,
                 (cmd.bounds[2] - cmd.bounds[0]) / (float)frame_width,
@@ -692,9 +721,12 @@ int GLWorkerCompositor::Composite(DrmHwcLayer *layers,
       glUniform1i(gl_tex_loc, src_index);
       glUniformMatrix2fv(gl_tex_matrix_loc + src_index, 1, GL_FALSE,
                          src.texture_matrix);
+      glUniform4f(gl_color_loc + src_index, src.color[0], src.color[1],
+                  src.color[2], src.color[3]);
+      glUniform1f(gl_solid_loc + src_index, src.solid);
       glActiveTexture(GL_TEXTURE0 + src_index);
       glBindTexture(GL_TEXTURE_EXTERNAL_OES,
-                    layer_textures[src.texture_index].texture.get());
+                    layer_texture_ids[src.texture_index]);
     }
 
     glScissor(cmd.bounds[0], cmd.bounds[1], cmd.bounds[2] - cmd.bounds[0],
@@ -731,8 +763,18 @@ void GLWorkerCompositor::Finish() {
   if (use_framebuffer_cache) {
     for (auto &fb : cached_framebuffers_)
       fb.strong_framebuffer.clear();
+
+    cached_layer_textures_.erase(
+        std::remove_if(cached_layer_textures_.begin(),
+                       cached_layer_textures_.end(),
+                       [this](const CachedLayerTexture &tex) {
+                         return composite_count_ - tex.last_used >=
+                                kLayerTextureCacheFrames;
+                       }),
+        cached_layer_textures_.end());
   } else {
     cached_framebuffers_.clear();
+    cached_layer_textures_.clear();
   }
 }
 
@@ -819,6 +861,49 @@ GLWorkerCompositor::PrepareAndCacheFramebuffer(
   return &cached_framebuffers_.back();
 }
 
+GLuint GLWorkerCompositor::PrepareAndCacheLayerTexture(
+    DrmHwcLayer *layer, Importer *importer,
+    AutoEGLImageAndGLTexture *uncached) {
+  buffer_handle_t handle = layer->get_usable_handle();
+  uint64_t buffer_id = layer->buffer ? importer->GetBufferId(handle) : 0;
+  if (buffer_id == 0) {
+    if (CreateTextureFromHandle(egl_display_, handle, importer, uncached))
+      return 0;
+    return uncached->texture.get();
+  }
+
+  // The same memory may be reinterpreted with a different size or format, in
+  // which case the old image is of no use anymore.
+  const hwc_drm_bo_t *bo = layer->buffer.operator->();
+  for (auto it = cached_layer_textures_.begin();
+       it != cached_layer_textures_.end(); ++it) {
+    if (it->buffer_id != buffer_id)
+      continue;
+
+    if (it->width == bo->width && it->height == bo->height &&
+        it->format == bo->format) {
+      it->last_used = composite_count_;
+      return it->texture.texture.get();
+    }
+    cached_layer_textures_.erase(it);
+    break;
+  }
+
+  AutoEGLImageAndGLTexture texture;
+  if (CreateTextureFromHandle(egl_display_, handle, importer, &texture))
+    return 0;
+
+  cached_layer_textures_.emplace_back();
+  CachedLayerTexture &cached = cached_layer_textures_.back();
+  cached.buffer_id = buffer_id;
+  cached.width = bo->width;
+  cached.height = bo->height;
+  cached.format = bo->format;
+  cached.last_used = composite_count_;
+  cached.texture = std::move(texture);
+  return cached.texture.texture.get();
+}
+
 GLint GLWorkerCompositor::PrepareAndCacheProgram(unsigned texture_count) {
   if (blend_programs_.size() >= texture_count) {
     GLint program = blend_programs_[texture_count - 1].get();
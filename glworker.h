@@ -64,6 +64,20 @@ class GLWorkerCompositor {
     bool Promote();
   };
 
+  // Layer buffers stay wrapped in an EGLImage and texture for
+  // kLayerTextureCacheFrames calls to Composite after they were last used,
+  // so that recycled BufferQueue buffers only need to be imported once.
+  static const unsigned kLayerTextureCacheFrames = 8;
+
+  struct CachedLayerTexture {
+    uint64_t buffer_id;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    uint64_t last_used;
+    AutoEGLImageAndGLTexture texture;
+  };
+
   struct {
     EGLDisplay saved_egl_display = EGL_NO_DISPLAY;
     EGLContext saved_egl_ctx = EGL_NO_CONTEXT;
@@ -79,6 +93,9 @@ class GLWorkerCompositor {
   CachedFramebuffer *PrepareAndCacheFramebuffer(
       const sp<GraphicBuffer> &framebuffer);
 
+  GLuint PrepareAndCacheLayerTexture(DrmHwcLayer *layer, Importer *importer,
+                                     AutoEGLImageAndGLTexture *uncached);
+
   GLint PrepareAndCacheProgram(unsigned texture_count);
 
   EGLDisplay egl_display_;
@@ -88,6 +105,8 @@ class GLWorkerCompositor {
   AutoGLBuffer vertex_buffer_;
 
   std::vector<CachedFramebuffer> cached_framebuffers_;
+  std::vector<CachedLayerTexture> cached_layer_textures_;
+  uint64_t composite_count_ = 0;
 };
 }
 
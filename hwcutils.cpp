@@ -17,15 +17,19 @@
 #define ATRACE_TAG ATRACE_TAG_GRAPHICS
 #define LOG_TAG "hwc-drm-utils"
 
+#include "autolock.h"
 #include "drmhwcomposer.h"
 #include "platform.h"
 
+#include <algorithm>
+#include <cinttypes>
+
 #include <log/log.h>
 
 namespace android {
 
 const hwc_drm_bo *DrmHwcBuffer::operator->() const {
-  if (importer_ == NULL) {
+  if (importer_ == NULL && !borrowed_) {
     ALOGE("Access of non-existent BO");
     exit(1);
     return NULL;
@@ -38,6 +42,14 @@ void DrmHwcBuffer::Clear() {
     importer_->ReleaseBuffer(&bo_);
     importer_ = NULL;
   }
+  borrowed_ = false;
+}
+
+DrmHwcBuffer DrmHwcBuffer::Borrow() const {
+  DrmHwcBuffer buffer;
+  buffer.bo_ = bo_;
+  buffer.borrowed_ = *this;
+  return buffer;
 }
 
 int DrmHwcBuffer::ImportBuffer(buffer_handle_t handle, Importer *importer) {
@@ -47,9 +59,7 @@ int DrmHwcBuffer::ImportBuffer(buffer_handle_t handle, Importer *importer) {
   if (ret)
     return ret;
 
-  if (importer_ != NULL) {
-    importer_->ReleaseBuffer(&bo_);
-  }
+  Clear();
 
   importer_ = importer;
 
@@ -108,12 +118,37 @@ int DrmHwcNativeHandle::CopyBufferHandle(buffer_handle_t handle,
   return 0;
 }
 
+int DrmHwcNativeHandle::CopyBufferHandle(buffer_handle_t handle,
+                                         DrmHwcNativeHandleCache *cache) {
+  native_handle_t *handle_copy;
+  uint64_t key;
+  int ret = cache->Acquire(handle, &handle_copy, &key);
+  if (ret)
+    return ret;
+
+  Clear();
+
+  gralloc_ = cache->gralloc();
+  handle_ = handle_copy;
+  if (key) {
+    cache_ = cache;
+    cache_key_ = key;
+  }
+
+  return 0;
+}
+
 DrmHwcNativeHandle::~DrmHwcNativeHandle() {
   Clear();
 }
 
 void DrmHwcNativeHandle::Clear() {
-  if (gralloc_ != NULL && handle_ != NULL) {
+  if (cache_ != NULL) {
+    cache_->Release(cache_key_);
+    cache_ = NULL;
+    gralloc_ = NULL;
+    handle_ = NULL;
+  } else if (gralloc_ != NULL && handle_ != NULL) {
     gralloc_->unregisterBuffer(gralloc_, handle_);
     free_buffer_handle(handle_);
     gralloc_ = NULL;
@@ -121,6 +156,170 @@ void DrmHwcNativeHandle::Clear() {
   }
 }
 
+DrmHwcNativeHandleCache::DrmHwcNativeHandleCache(
+    const gralloc_module_t *gralloc, Importer *importer)
+    : gralloc_(gralloc), importer_(importer) {
+  pthread_mutex_init(&lock_, NULL);
+}
+
+DrmHwcNativeHandleCache::~DrmHwcNativeHandleCache() {
+  for (auto it = handles_.begin(); it != handles_.end();)
+    FreeEntry(it++);
+  pthread_mutex_destroy(&lock_);
+}
+
+static native_handle_t *register_buffer_handle(buffer_handle_t handle,
+                                               const gralloc_module_t *gralloc,
+                                               int *ret) {
+  native_handle_t *handle_copy = dup_buffer_handle(handle);
+  if (handle_copy == NULL) {
+    ALOGE("Failed to duplicate handle");
+    *ret = -ENOMEM;
+    return NULL;
+  }
+
+  *ret = gralloc->registerBuffer(gralloc, handle_copy);
+  if (*ret) {
+    ALOGE("Failed to register buffer handle %d", *ret);
+    free_buffer_handle(handle_copy);
+    return NULL;
+  }
+  return handle_copy;
+}
+
+int DrmHwcNativeHandleCache::Acquire(buffer_handle_t handle,
+                                     native_handle_t **handle_copy,
+                                     uint64_t *key) {
+  int ret = 0;
+  *key = importer_->GetBufferId(handle);
+  if (!*key) {
+    *handle_copy = register_buffer_handle(handle, gralloc_, &ret);
+    return ret;
+  }
+
+  AutoLock lock(&lock_, "handle-cache");
+  ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  auto cached = handles_.find(*key);
+  if (cached != handles_.end() && !cached->second.evict) {
+    if (SameInts(cached->second, handle)) {
+      if (!cached->second.refs++)
+        --idle_handles_;
+      *handle_copy = cached->second.handle;
+      return 0;
+    }
+
+    // Same buffer id but different metadata, the cached copy is stale
+    if (cached->second.refs) {
+      cached->second.evict = true;
+    } else {
+      --idle_handles_;
+      FreeEntry(cached);
+      cached = handles_.end();
+    }
+  }
+
+  native_handle_t *new_handle = register_buffer_handle(handle, gralloc_, &ret);
+  if (!new_handle)
+    return ret;
+
+  // An entry on its way out is still referenced, hand out an uncached copy
+  if (cached != handles_.end()) {
+    *key = 0;
+    *handle_copy = new_handle;
+    return 0;
+  }
+
+  Entry &entry = handles_[*key];
+  entry.handle = new_handle;
+  entry.ints.assign(&handle->data[handle->numFds],
+                    &handle->data[handle->numFds + handle->numInts]);
+  entry.refs = 1;
+  *handle_copy = new_handle;
+  return 0;
+}
+
+void DrmHwcNativeHandleCache::Release(uint64_t key) {
+  AutoLock lock(&lock_, "handle-cache");
+  if (lock.Lock())
+    return;
+
+  auto cached = handles_.find(key);
+  if (cached == handles_.end() || !cached->second.refs) {
+    ALOGE("Unbalanced release of cached handle %" PRIu64, key);
+    return;
+  }
+
+  if (--cached->second.refs)
+    return;
+
+  if (cached->second.evict) {
+    FreeEntry(cached);
+    return;
+  }
+
+  cached->second.last_release = ++release_count_;
+  ++idle_handles_;
+  EvictIdleHandles();
+}
+
+void DrmHwcNativeHandleCache::ReleaseCachedBuffer(buffer_handle_t handle) {
+  uint64_t key = importer_->GetBufferId(handle);
+  if (!key)
+    return;
+
+  AutoLock lock(&lock_, "handle-cache");
+  if (lock.Lock())
+    return;
+
+  auto cached = handles_.find(key);
+  if (cached == handles_.end())
+    return;
+
+  if (cached->second.refs) {
+    cached->second.evict = true;
+    return;
+  }
+
+  --idle_handles_;
+  FreeEntry(cached);
+}
+
+// static
+bool DrmHwcNativeHandleCache::SameInts(const Entry &entry,
+                                       buffer_handle_t handle) {
+  return entry.ints.size() == (size_t)handle->numInts &&
+         std::equal(entry.ints.begin(), entry.ints.end(),
+                    &handle->data[handle->numFds]);
+}
+
+void DrmHwcNativeHandleCache::FreeEntry(
+    std::map<uint64_t, Entry>::iterator entry) {
+  gralloc_->unregisterBuffer(gralloc_, entry->second.handle);
+  free_buffer_handle(entry->second.handle);
+  handles_.erase(entry);
+}
+
+void DrmHwcNativeHandleCache::EvictIdleHandles() {
+  while (idle_handles_ > kMaxIdleHandles) {
+    auto oldest = handles_.end();
+    for (auto it = handles_.begin(); it != handles_.end(); ++it) {
+      if (it->second.refs)
+        continue;
+      if (oldest == handles_.end() ||
+          it->second.last_release < oldest->second.last_release)
+        oldest = it;
+    }
+    if (oldest == handles_.end())
+      break;
+
+    FreeEntry(oldest);
+    --idle_handles_;
+  }
+}
+
 int DrmHwcLayer::InitFromHwcLayer(hwc_layer_1_t *sf_layer, Importer *importer,
                                   const gralloc_module_t *gralloc) {
   alpha = sf_layer->planeAlpha;
@@ -164,6 +363,21 @@ int DrmHwcLayer::ImportBuffer(Importer *importer,
   return 0;
 }
 
+int DrmHwcLayer::ImportBuffer(Importer *importer,
+                              DrmHwcNativeHandleCache *handle_cache) {
+  int ret = buffer.ImportBuffer(sf_handle, importer);
+  if (ret)
+    return ret;
+
+  ret = handle.CopyBufferHandle(sf_handle, handle_cache);
+  if (ret)
+    return ret;
+
+  gralloc_buffer_usage = buffer.operator->()->usage;
+
+  return 0;
+}
+
 void DrmHwcLayer::SetSourceCrop(hwc_frect_t const &crop) {
   source_crop = DrmHwcRect<float>(crop.left, crop.top, crop.right, crop.bottom);
 }
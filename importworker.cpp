@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#define LOG_TAG "hwc-import-worker"
+
+#include "importworker.h"
+#include "platform.h"
+
+#include <stdlib.h>
+
+#include <cutils/properties.h>
+#include <hardware/hardware.h>
+#include <log/log.h>
+#include <utils/Trace.h>
+
+namespace android {
+
+ImportWorker::ImportWorker()
+    : Worker("drm-importer", HAL_PRIORITY_URGENT_DISPLAY) {
+}
+
+ImportWorker::~ImportWorker() {
+  Exit();
+
+  // Nobody will import what is left, don't let a late CollectImport hang
+  Lock();
+  while (!queue_.empty()) {
+    queue_.front()->status = -ENODEV;
+    queue_.front()->done = true;
+    queue_.pop();
+  }
+  Unlock();
+  done_cond_.notify_all();
+}
+
+int ImportWorker::Init(Importer *importer,
+                       DrmHwcNativeHandleCache *handle_cache) {
+  importer_ = importer;
+  handle_cache_ = handle_cache;
+
+  char async_import_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.async_import", async_import_prop, "1");
+  if (!atoi(async_import_prop))
+    return 0;
+
+  return InitWorker();
+}
+
+std::shared_ptr<DrmHwcPendingImport> ImportWorker::QueueImport(
+    buffer_handle_t handle) {
+  std::shared_ptr<DrmHwcPendingImport> import =
+      std::make_shared<DrmHwcPendingImport>();
+  import->handle = handle;
+
+  if (!initialized()) {
+    Import(import.get());
+    import->done = true;
+    return import;
+  }
+
+  Lock();
+  queue_.push(import);
+  Unlock();
+  Signal();
+  return import;
+}
+
+int ImportWorker::CollectImport(
+    const std::shared_ptr<DrmHwcPendingImport> &import, DrmHwcLayer *layer) {
+  ATRACE_CALL();
+  std::unique_lock<std::mutex> lk(mutex_);
+  done_cond_.wait(lk, [&import]() { return import->done; });
+  lk.unlock();
+
+  if (import->status)
+    return import->status;
+
+  layer->buffer = std::move(import->buffer);
+  layer->handle = std::move(import->native_handle);
+  layer->gralloc_buffer_usage = layer->buffer->usage;
+  return 0;
+}
+
+void ImportWorker::CancelImport(
+    const std::shared_ptr<DrmHwcPendingImport> &import) {
+  std::unique_lock<std::mutex> lk(mutex_);
+  import->cancelled = true;
+  done_cond_.wait(lk, [&import]() { return !import->started || import->done; });
+}
+
+void ImportWorker::Import(DrmHwcPendingImport *import) {
+  ATRACE_CALL();
+  import->status = import->buffer.ImportBuffer(import->handle, importer_);
+  if (import->status) {
+    ALOGE("Failed to import buffer %p ret=%d", import->handle, import->status);
+    return;
+  }
+
+  import->status =
+      import->native_handle.CopyBufferHandle(import->handle, handle_cache_);
+  if (import->status)
+    ALOGE("Failed to copy buffer handle %p ret=%d", import->handle,
+          import->status);
+}
+
+void ImportWorker::Routine() {
+  Lock();
+  if (queue_.empty()) {
+    int ret = WaitForSignalOrExitLocked();
+    if (ret == -EINTR || queue_.empty()) {
+      Unlock();
+      return;
+    }
+  }
+
+  std::shared_ptr<DrmHwcPendingImport> import = queue_.front();
+  queue_.pop();
+  if (import->cancelled) {
+    import->status = -ECANCELED;
+    import->done = true;
+    Unlock();
+    done_cond_.notify_all();
+    return;
+  }
+  import->started = true;
+  Unlock();
+
+  Import(import.get());
+
+  Lock();
+  import->done = true;
+  Unlock();
+  done_cond_.notify_all();
+}
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_IMPORT_WORKER_H_
+#define ANDROID_IMPORT_WORKER_H_
+
+#include "drmhwcomposer.h"
+#include "worker.h"
+
+#include <condition_variable>
+#include <memory>
+#include <queue>
+
+namespace android {
+
+// A layer buffer import started ahead of PresentDisplay
+struct DrmHwcPendingImport {
+  buffer_handle_t handle = NULL;
+  bool started = false;
+  bool cancelled = false;
+  bool done = false;
+  int status = 0;
+  DrmHwcBuffer buffer;
+  DrmHwcNativeHandle native_handle;
+};
+
+// Imports layer buffers as soon as surfaceflinger hands them to us, so that
+// PresentDisplay only has to pick up the result. When the worker thread is
+// disabled (hwc.drm.async_import=0) buffers are imported inline instead.
+class ImportWorker : public Worker {
+ public:
+  ImportWorker();
+  ~ImportWorker() override;
+
+  int Init(Importer *importer, DrmHwcNativeHandleCache *handle_cache);
+
+  std::shared_ptr<DrmHwcPendingImport> QueueImport(buffer_handle_t handle);
+
+  // Waits for import to finish and moves its result into layer
+  int CollectImport(const std::shared_ptr<DrmHwcPendingImport> &import,
+                    DrmHwcLayer *layer);
+
+  // Drops import if it hasn't started yet, otherwise waits for it to finish
+  void CancelImport(const std::shared_ptr<DrmHwcPendingImport> &import);
+
+ protected:
+  void Routine() override;
+
+ private:
+  void Import(DrmHwcPendingImport *import);
+
+  Importer *importer_ = NULL;
+  DrmHwcNativeHandleCache *handle_cache_ = NULL;
+
+  std::queue<std::shared_ptr<DrmHwcPendingImport>> queue_;
+  std::condition_variable done_cond_;
+};
+}
+
+#endif
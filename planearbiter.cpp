@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-plane-arbiter"
+
+#include "planearbiter.h"
+#include "autolock.h"
+#include "drmcrtc.h"
+#include "drmplane.h"
+#include "drmresources.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <cutils/properties.h>
+#include <log/log.h>
+
+namespace android {
+
+PlaneArbiter::PlaneArbiter() {
+  pthread_mutex_init(&lock_, NULL);
+}
+
+PlaneArbiter::~PlaneArbiter() {
+  pthread_mutex_destroy(&lock_);
+}
+
+int PlaneArbiter::Init(DrmResources *drm) {
+  char hysteresis_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.plane_share_hysteresis", hysteresis_prop, "30");
+  unsigned hysteresis = strtoul(hysteresis_prop, NULL, 10);
+
+  std::vector<DrmPlane *> overlay_planes;
+  for (auto &plane : drm->planes()) {
+    if (plane->type() == DRM_PLANE_TYPE_OVERLAY)
+      overlay_planes.push_back(plane.get());
+  }
+  return Init(overlay_planes, hysteresis);
+}
+
+int PlaneArbiter::Init(const std::vector<DrmPlane *> &overlay_planes,
+                       unsigned hysteresis) {
+  hysteresis_ = hysteresis;
+  for (DrmPlane *plane : overlay_planes) {
+    PlaneState state;
+    state.plane = plane;
+    planes_.push_back(state);
+  }
+  return 0;
+}
+
+int PlaneArbiter::AddDisplay(int display, DrmCrtc *crtc) {
+  AutoLock lock(&lock_, "plane arbiter");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  if (displays_.count(display)) {
+    ALOGE("Display %d was already added to the plane arbiter", display);
+    return -EEXIST;
+  }
+  displays_[display].crtc = crtc;
+
+  // Displays are added before any of them composes a frame, so ownership can
+  // simply be recomputed from scratch
+  for (PlaneState &state : planes_) {
+    int users = 0;
+    int user = -1;
+    for (auto &d : displays_) {
+      if (!state.plane->GetCrtcSupported(*d.second.crtc))
+        continue;
+      ++users;
+      user = d.first;
+    }
+    state.shared = users > 1;
+    state.owner = users == 1 ? user : -1;
+    state.releasing = false;
+  }
+  return 0;
+}
+
+size_t PlaneArbiter::CountOwned(int display) const {
+  size_t owned = 0;
+  for (const PlaneState &state : planes_) {
+    if (state.owner == display && !state.releasing)
+      ++owned;
+  }
+  return owned;
+}
+
+bool PlaneArbiter::OtherDisplayWants(int display, const DrmPlane *plane) const {
+  for (auto &d : displays_) {
+    if (d.first != display && d.second.starved &&
+        plane->GetCrtcSupported(*d.second.crtc))
+      return true;
+  }
+  return false;
+}
+
+void PlaneArbiter::AcquirePlanes(int display, uint64_t frame_no, size_t demand,
+                                 std::vector<DrmPlane *> *planes,
+                                 std::vector<DrmPlane *> *released) {
+  AutoLock lock(&lock_, "plane arbiter");
+  if (lock.Lock())
+    return;
+
+  auto it = displays_.find(display);
+  if (it == displays_.end())
+    return;
+  DisplayState &display_state = it->second;
+  display_state.demand = demand;
+  display_state.last_frame = frame_no;
+
+  size_t owned = CountOwned(display);
+  for (PlaneState &state : planes_) {
+    if (owned >= demand)
+      break;
+    if (!state.shared || state.owner >= 0 ||
+        !state.plane->GetCrtcSupported(*display_state.crtc))
+      continue;
+    state.owner = display;
+    ++owned;
+    ++claimed_planes_;
+  }
+  display_state.starved = owned < demand;
+
+  if (owned > demand)
+    ++display_state.surplus_frames;
+  else
+    display_state.surplus_frames = 0;
+
+  // Give back the shared planes we've been holding on to without need, as
+  // long as someone else can make use of them. The last planes go first since
+  // the planner fills planes from the front.
+  if (display_state.surplus_frames >= hysteresis_) {
+    for (auto i = planes_.rbegin(); i != planes_.rend() && owned > demand;
+         ++i) {
+      if (!i->shared || i->owner != display || i->releasing ||
+          !OtherDisplayWants(display, i->plane))
+        continue;
+      i->releasing = true;
+      --owned;
+      ++released_planes_;
+    }
+  }
+
+  for (PlaneState &state : planes_) {
+    if (state.owner != display)
+      continue;
+    if (state.releasing)
+      released->push_back(state.plane);
+    else
+      planes->push_back(state.plane);
+  }
+}
+
+void PlaneArbiter::FrameCommitted(int display, uint64_t frame_no) {
+  AutoLock lock(&lock_, "plane arbiter");
+  if (lock.Lock())
+    return;
+
+  // Frames queued after this one disable the released planes as well
+  auto it = displays_.find(display);
+  if (it == displays_.end() || it->second.last_frame != frame_no)
+    return;
+
+  for (PlaneState &state : planes_) {
+    if (state.owner == display && state.releasing) {
+      state.owner = -1;
+      state.releasing = false;
+    }
+  }
+}
+
+void PlaneArbiter::ReleaseAll(int display) {
+  AutoLock lock(&lock_, "plane arbiter");
+  if (lock.Lock())
+    return;
+
+  auto it = displays_.find(display);
+  if (it == displays_.end())
+    return;
+  it->second.demand = 0;
+  it->second.surplus_frames = 0;
+  it->second.starved = false;
+
+  for (PlaneState &state : planes_) {
+    if (state.shared && state.owner == display) {
+      if (!state.releasing)
+        ++released_planes_;
+      state.owner = -1;
+      state.releasing = false;
+    }
+  }
+}
+
+void PlaneArbiter::Dump(std::ostringstream *out) const {
+  AutoLock lock(&lock_, "plane arbiter");
+  if (lock.Lock())
+    return;
+
+  *out << "--PlaneArbiter: hysteresis=" << hysteresis_
+       << " claimed=" << claimed_planes_ << " released=" << released_planes_
+       << "\n";
+  for (auto &d : displays_) {
+    *out << "    display " << d.first << ": demand=" << d.second.demand
+         << " owned=" << CountOwned(d.first)
+         << (d.second.starved ? " starved" : "") << "\n";
+  }
+  for (const PlaneState &state : planes_) {
+    *out << "    plane " << state.plane->id() << ": "
+         << (state.shared ? "shared" : "dedicated") << " owner="
+         << state.owner << (state.releasing ? " releasing" : "") << "\n";
+  }
+}
+}
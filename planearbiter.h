@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_PLANE_ARBITER_H_
+#define ANDROID_PLANE_ARBITER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <map>
+#include <sstream>
+#include <vector>
+
+namespace android {
+
+class DrmCrtc;
+class DrmPlane;
+class DrmResources;
+
+// Hands out the overlay planes to the displays. Overlays that only one
+// display's crtc can use are always given to that display. Overlays that
+// several displays could use are shared: a display claims free ones up to its
+// layer demand, and gives one back once it has wanted fewer planes than it
+// holds for hwc.drm.plane_share_hysteresis frames while another display is
+// short of planes. A plane that's given back is disabled by all of its owner's
+// following frames, and only becomes free once the latest of them is on the
+// screen, since frames may still be queued behind the one that committed.
+class PlaneArbiter {
+ public:
+  PlaneArbiter();
+  ~PlaneArbiter();
+
+  int Init(DrmResources *drm);
+  // Arbitrates overlay_planes instead of drm's overlays, ie: for tests
+  int Init(const std::vector<DrmPlane *> &overlay_planes, unsigned hysteresis);
+  int AddDisplay(int display, DrmCrtc *crtc);
+
+  // Fills planes with the overlays display may use for frame frame_no, which
+  // wants demand overlays. Planes the display gave back are put in released;
+  // the frame must disable them.
+  void AcquirePlanes(int display, uint64_t frame_no, size_t demand,
+                     std::vector<DrmPlane *> *planes,
+                     std::vector<DrmPlane *> *released);
+
+  // Called once frame frame_no from AcquirePlanes is on the screen
+  void FrameCommitted(int display, uint64_t frame_no);
+
+  // Called once display has disabled all of its planes, ie. when it's off
+  void ReleaseAll(int display);
+
+  void Dump(std::ostringstream *out) const;
+
+ private:
+  static const unsigned kDefaultHysteresis = 30;
+
+  struct PlaneState {
+    DrmPlane *plane;
+    bool shared = false;
+    int owner = -1;
+    bool releasing = false;
+  };
+
+  struct DisplayState {
+    DrmCrtc *crtc = NULL;
+    size_t demand = 0;
+    uint64_t last_frame = 0;
+    unsigned surplus_frames = 0;
+    bool starved = false;
+  };
+
+  size_t CountOwned(int display) const;
+  bool OtherDisplayWants(int display, const DrmPlane *plane) const;
+
+  unsigned hysteresis_ = kDefaultHysteresis;
+  std::vector<PlaneState> planes_;
+  std::map<int, DisplayState> displays_;
+
+  uint64_t claimed_planes_ = 0;
+  uint64_t released_planes_ = 0;
+
+  mutable pthread_mutex_t lock_;
+};
+}
+
+#endif
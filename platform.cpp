@@ -19,10 +19,42 @@
 #include "drmresources.h"
 #include "platform.h"
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <cutils/properties.h>
+#include <drm/drm_fourcc.h>
 #include <log/log.h>
 
 namespace android {
 
+void Planner::AddProvisioningStage() {
+  char planner_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.planner", planner_prop, "greedy");
+  if (!strcmp(planner_prop, "cost")) {
+    AddStage<PlanStagePrecomp>();
+    AddStage<PlanStageCost>();
+    return;
+  }
+
+  if (strcmp(planner_prop, "greedy"))
+    ALOGW("Unknown planner %s, using greedy", planner_prop);
+
+  char max_precomp_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.max_precomp_planes", max_precomp_prop, "2");
+  unsigned max_precomp_planes = std::min(
+      std::max(atoi(max_precomp_prop), 1), DRM_MAX_PRECOMP_PLANES);
+
+  // With a single precomp plane, everything above a precomposited layer has to
+  // be precomposited as well
+  if (max_precomp_planes == 1)
+    AddStage<PlanStagePrecomp>();
+  AddStage<PlanStageGreedy>(max_precomp_planes);
+}
+
 std::vector<DrmPlane *> Planner::GetUsablePlanes(
     DrmCrtc *crtc, std::vector<DrmPlane *> *primary_planes,
     std::vector<DrmPlane *> *overlay_planes) {
@@ -48,6 +80,29 @@ std::tuple<int, std::vector<DrmCompositionPlane>> Planner::ProvisionPlanes(
     return std::make_tuple(-ENODEV, std::vector<DrmCompositionPlane>());
   }
 
+  // Cursor planes can't scan out anything but the cursor, so they're taken
+  // out of the pool before reserving planes for the rest
+  std::vector<DrmPlane *> cursor_planes;
+  for (auto i = planes.begin(); i != planes.end();) {
+    if ((*i)->type() == DRM_PLANE_TYPE_CURSOR) {
+      cursor_planes.push_back(*i);
+      i = planes.erase(i);
+    } else {
+      ++i;
+    }
+  }
+
+  std::vector<DrmCompositionPlane> cursor_composition;
+  if (!cursor_planes.empty()) {
+    PlanStageCursor cursor;
+    int ret = cursor.ProvisionPlanes(&cursor_composition, layers, crtc,
+                                     &cursor_planes);
+    if (ret) {
+      ALOGE("Failed provision cursor stage with ret %d", ret);
+      return std::make_tuple(ret, std::vector<DrmCompositionPlane>());
+    }
+  }
+
   // If needed, reserve the squash plane at the highest z-order
   DrmPlane *squash_plane = NULL;
   if (use_squash_fb) {
@@ -85,9 +140,85 @@ std::tuple<int, std::vector<DrmCompositionPlane>> Planner::ProvisionPlanes(
     composition.emplace_back(DrmCompositionPlane::Type::kSquash, squash_plane,
                              crtc);
 
+  // The cursor goes on top of everything, squash included
+  composition.insert(composition.end(), cursor_composition.begin(),
+                     cursor_composition.end());
+
+  AssignZpos(&composition);
   return std::make_tuple(0, std::move(composition));
 }
 
+// Assigns increasing zpos values to the enabled planes in the order they
+// appear in composition. Returns false if that order doesn't fit the planes'
+// zpos ranges, in which case no zpos is set.
+static bool AssignIncreasingZpos(
+    std::vector<DrmCompositionPlane> *composition) {
+  int64_t zpos = -1;
+  for (DrmCompositionPlane &comp_plane : *composition) {
+    comp_plane.set_zpos(-1);
+    if (comp_plane.type() == DrmCompositionPlane::Type::kDisable)
+      continue;
+
+    DrmPlane *plane = comp_plane.plane();
+    zpos = std::max(zpos + 1, (int64_t)plane->zpos_min());
+    if (zpos > (int64_t)plane->zpos_max()) {
+      for (DrmCompositionPlane &p : *composition)
+        p.set_zpos(-1);
+      return false;
+    }
+    comp_plane.set_zpos(zpos);
+  }
+  return true;
+}
+
+// The layer which decides where a plane goes in the stack. Precomp planes
+// must cover the topmost layer they contain.
+static size_t GetZposKey(const DrmCompositionPlane &comp_plane) {
+  switch (comp_plane.type()) {
+    case DrmCompositionPlane::Type::kLayer:
+      return comp_plane.source_layers().front();
+    case DrmCompositionPlane::Type::kPrecomp:
+      if (!comp_plane.source_layers().empty())
+        return *std::max_element(comp_plane.source_layers().begin(),
+                                 comp_plane.source_layers().end());
+      return SIZE_MAX - 2;
+    case DrmCompositionPlane::Type::kSquash:
+      return SIZE_MAX - 1;
+    default:
+      return SIZE_MAX;
+  }
+}
+
+// static
+void Planner::AssignZpos(std::vector<DrmCompositionPlane> *composition) {
+  for (DrmCompositionPlane &comp_plane : *composition) {
+    comp_plane.set_zpos(-1);
+    if (comp_plane.type() == DrmCompositionPlane::Type::kDisable)
+      continue;
+    if (!comp_plane.plane() || !comp_plane.plane()->zpos_property().id())
+      return;
+    if (comp_plane.type() == DrmCompositionPlane::Type::kLayer &&
+        comp_plane.source_layers().empty())
+      return;
+  }
+
+  std::vector<DrmCompositionPlane> sorted = *composition;
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const DrmCompositionPlane &a,
+                      const DrmCompositionPlane &b) {
+    return GetZposKey(a) < GetZposKey(b);
+  });
+  if (AssignIncreasingZpos(&sorted)) {
+    *composition = std::move(sorted);
+    return;
+  }
+
+  // Stick to the plane order, but still set zpos since an earlier frame may
+  // have reordered the planes
+  if (!AssignIncreasingZpos(composition))
+    ALOGW("Plane zpos ranges don't fit the composition");
+}
+
 int PlanStageProtected::ProvisionPlanes(
     std::vector<DrmCompositionPlane> *composition,
     std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
@@ -101,7 +232,7 @@ int PlanStageProtected::ProvisionPlanes(
     }
 
     ret = Emplace(composition, planes, DrmCompositionPlane::Type::kLayer, crtc,
-                  i->first);
+                  std::make_pair(i->first, i->second));
     if (ret)
       ALOGE("Failed to dedicate protected layer! Dropping it.");
 
@@ -172,24 +303,383 @@ int PlanStageGreedy::ProvisionPlanes(
     std::vector<DrmCompositionPlane> *composition,
     std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
     std::vector<DrmPlane *> *planes) {
-  // Fill up the remaining planes
-  for (auto i = layers.begin(); i != layers.end(); i = layers.erase(i)) {
-    int ret = Emplace(composition, planes, DrmCompositionPlane::Type::kLayer,
-                      crtc, i->first);
-    // We don't have any planes left
-    if (ret == -ENOENT)
+  // Layers earlier stages put in the topmost precomp plane which are below
+  // layers we still have to place are precomposited where they are, if we're
+  // allowed another precomp plane. They're the ones without a DrmHwcLayer.
+  std::map<size_t, DrmHwcLayer *> stack(layers);
+  DrmCompositionPlane *precomp = GetPrecomp(composition);
+  bool have_top_precomp = precomp != NULL;
+  if (precomp && !layers.empty() && max_precomp_planes_ > 1) {
+    std::vector<size_t> &precomp_layers = precomp->source_layers();
+    for (auto i = precomp_layers.begin(); i != precomp_layers.end();) {
+      if (*i < layers.rbegin()->first) {
+        stack.emplace(*i, (DrmHwcLayer *)NULL);
+        i = precomp_layers.erase(i);
+      } else {
+        ++i;
+      }
+    }
+  }
+  layers.clear();
+
+  // Planes go right below the topmost precomp plane, or on top if there's none
+  // yet. The one open precomp plane is extended for as long as layers keep
+  // failing to get a plane of their own.
+  auto insert = [&](DrmCompositionPlane comp_plane) {
+    auto pos = have_top_precomp ? GetPrecompIter(composition)
+                                : composition->end();
+    return composition->insert(pos, std::move(comp_plane)) -
+           composition->begin();
+  };
+  unsigned num_precomp_planes = have_top_precomp ? 1 : 0;
+  ssize_t open_precomp = -1;
+
+  for (auto i = stack.begin(); i != stack.end(); ++i) {
+    size_t layers_above = std::distance(i, stack.end()) - 1;
+    // Without a topmost precomp plane, keep a plane for one in case we run out
+    size_t reserve = !have_top_precomp && layers_above ? 1 : 0;
+
+    if (i->second) {
+      auto plane = std::find_if(planes->begin(), planes->end(),
+                                [&](DrmPlane *p) {
+        return p->IsValidForLayer(i->second);
+      });
+      if (plane != planes->end() &&
+          (size_t)(planes->end() - plane - 1) >= reserve) {
+        DrmPlane *layer_plane = *plane;
+        planes->erase(planes->begin(), plane + 1);
+        insert(DrmCompositionPlane(DrmCompositionPlane::Type::kLayer,
+                                   layer_plane, crtc, i->first));
+        open_precomp = -1;
+        continue;
+      }
+    }
+
+    if (open_precomp >= 0) {
+      (*composition)[open_precomp].source_layers().emplace_back(i->first);
+      continue;
+    }
+
+    // Only start another precomp plane if there's one left for the topmost
+    // precomp plane and one for a dedicated layer above
+    if (num_precomp_planes + 1 < max_precomp_planes_ &&
+        planes->size() >= 1 + (layers_above ? 1 + reserve : 0)) {
+      open_precomp = insert(DrmCompositionPlane(
+          DrmCompositionPlane::Type::kPrecomp, PopPlane(planes), crtc,
+          i->first));
+      ++num_precomp_planes;
+      continue;
+    }
+
+    // Put the rest of the layers in the topmost precomp plane. If we stopped
+    // on a layer none of the planes could handle, there may not be one
+    // reserved yet.
+    precomp = GetPrecomp(composition);
+    if (!have_top_precomp && !planes->empty()) {
+      DrmPlane *precomp_plane = planes->back();
+      planes->pop_back();
+      composition->emplace_back(DrmCompositionPlane::Type::kPrecomp,
+                                precomp_plane, crtc);
+      precomp = &composition->back();
+    } else if (!have_top_precomp) {
+      // Anything we started is below some dedicated layer by now
+      precomp = NULL;
+    }
+    if (!precomp) {
+      ALOGE("Not enough planes to reserve for precomp fb");
       break;
-    else if (ret)
-      ALOGE("Failed to emplace layer %zu, dropping it", i->first);
+    }
+    for (; i != stack.end(); ++i)
+      precomp->source_layers().emplace_back(i->first);
+    break;
+  }
+
+  // The topmost precomp plane may have given all its layers away
+  precomp = GetPrecomp(composition);
+  if (have_top_precomp && precomp && precomp->source_layers().empty()) {
+    planes->push_back(precomp->plane());
+    composition->erase(GetPrecompIter(composition));
+  }
+
+  return 0;
+}
+
+static bool LayerIsScaled(DrmHwcLayer *layer) {
+  float src_w = layer->source_crop.width();
+  float src_h = layer->source_crop.height();
+  if (layer->transform & DrmHwcTransform::kRotate90)
+    std::swap(src_w, src_h);
+  return src_w != layer->display_frame.width() ||
+         src_h != layer->display_frame.height();
+}
+
+int PlanStageCursor::ProvisionPlanes(
+    std::vector<DrmCompositionPlane> *composition,
+    std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
+    std::vector<DrmPlane *> *planes) {
+  if (layers.empty())
+    return 0;
+
+  // Cursor planes sit above all other planes, so only the topmost layer can
+  // go there. Cursor planes generally can't scale either.
+  auto top = std::prev(layers.end());
+  DrmHwcLayer *layer = top->second;
+  if (!layer->cursor || layer->protected_usage() || LayerIsScaled(layer))
+    return 0;
+
+  if (!Emplace(composition, planes, DrmCompositionPlane::Type::kLayer, crtc,
+               std::make_pair(top->first, layer)))
+    layers.erase(top);
+  return 0;
+}
+
+// static
+void PlanStageScalingLimits::SetLimitsFromProperties(DrmResources *drm) {
+  char prop[PROPERTY_VALUE_MAX];
+  DrmPlaneScalingLimits limits;
+  property_get("hwc.drm.plane_max_upscale", prop, "0");
+  limits.max_upscale = strtof(prop, NULL);
+  property_get("hwc.drm.plane_max_downscale", prop, "0");
+  limits.max_downscale = strtof(prop, NULL);
+  property_get("hwc.drm.plane_min_src_size", prop, "0");
+  limits.min_src_width = limits.min_src_height = strtoul(prop, NULL, 10);
+
+  for (auto &plane : drm->planes())
+    plane->set_scaling_limits(limits);
+}
+
+int PlanStageScalingLimits::ProvisionPlanes(
+    std::vector<DrmCompositionPlane> *composition,
+    std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
+    std::vector<DrmPlane *> *planes) {
+  // Count the scalers we have, planes sharing one count once
+  size_t num_scalers = 0;
+  std::vector<uint32_t> scaler_groups;
+  for (DrmPlane *plane : *planes) {
+    const DrmPlaneScalingLimits &limits = plane->scaling_limits();
+    if (limits.max_upscale == 1.0f && limits.max_downscale == 1.0f)
+      continue;
+    if (!limits.scaler_group)
+      ++num_scalers;
+    else if (std::find(scaler_groups.begin(), scaler_groups.end(),
+                       limits.scaler_group) == scaler_groups.end())
+      scaler_groups.push_back(limits.scaler_group);
+  }
+  num_scalers += scaler_groups.size();
+
+  // Protected layers can't be precomposited, so they get first dibs
+  size_t num_scaled = 0;
+  for (auto &i : layers)
+    if (i.second->protected_usage() && LayerIsScaled(i.second))
+      ++num_scaled;
+
+  for (auto i = layers.begin(); i != layers.end();) {
+    if (i->second->protected_usage() || !LayerIsScaled(i->second) ||
+        ++num_scaled <= num_scalers) {
+      ++i;
+      continue;
+    }
+
+    DrmCompositionPlane *precomp = GetPrecomp(composition);
+    if (!precomp) {
+      if (planes->empty()) {
+        ALOGE("Not enough planes to reserve for precomp fb");
+        return 0;
+      }
+      DrmPlane *precomp_plane = planes->back();
+      planes->pop_back();
+      composition->emplace_back(DrmCompositionPlane::Type::kPrecomp,
+                                precomp_plane, crtc);
+      precomp = &composition->back();
+    }
+    precomp->source_layers().emplace_back(i->first);
+    i = layers.erase(i);
+  }
+  return 0;
+}
+
+// Cost of sampling one pixel of layer in the precomposition, relative to
+// writing one pixel of the precomp buffer
+static uint64_t LayerSampleCost(DrmHwcLayer *layer) {
+  // A solid color is a constant in the shader
+  if (layer->solid_color)
+    return 0;
+
+  uint64_t cost = 1;
+  if (layer->buffer) {
+    switch (layer->buffer->format) {
+      case DRM_FORMAT_YVU420:
+      case DRM_FORMAT_NV12:
+      case DRM_FORMAT_NV21:
+      case DRM_FORMAT_NV16:
+        cost += 1;
+        break;
+      default:
+        break;
+    }
+  }
+  if (LayerIsScaled(layer))
+    cost += 1;
+  return cost;
+}
+
+static bool LayerIsOpaque(DrmHwcLayer *layer) {
+  return layer->blending == DrmHwcBlending::kNone && layer->alpha == 0xff;
+}
+
+int PlanStageCost::ProvisionPlanes(
+    std::vector<DrmCompositionPlane> *composition,
+    std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
+    std::vector<DrmPlane *> *planes) {
+  if (layers.empty())
+    return 0;
+
+  // The layer masks below only have room for 64 layers
+  if (layers.size() > 64) {
+    PlanStageGreedy greedy;
+    return greedy.ProvisionPlanes(composition, layers, crtc, planes);
+  }
+
+  // Layers in z-order, bit i of the masks below refers to stack[i]
+  std::vector<std::pair<size_t, DrmHwcLayer *>> stack(layers.begin(),
+                                                      layers.end());
+  size_t num_layers = stack.size();
+  uint64_t all_layers = num_layers == 64 ? ~(uint64_t)0
+                                         : ((uint64_t)1 << num_layers) - 1;
+
+  std::vector<DrmHwcRect<int>> layer_rects;
+  std::vector<uint64_t> sample_costs;
+  for (auto &i : stack) {
+    layer_rects.emplace_back(i.second->display_frame);
+    sample_costs.emplace_back(LayerSampleCost(i.second));
+  }
+  std::vector<separate_rects::RectSet<uint64_t, int>> regions;
+  separate_rects::separate_rects_64(layer_rects, &regions);
+
+  std::vector<uint64_t> overlaps(num_layers, 0);
+  for (auto &region : regions) {
+    uint64_t ids = region.id_set.getBits();
+    for (size_t i = 0; i < num_layers; ++i)
+      if (ids & ((uint64_t)1 << i))
+        overlaps[i] |= ids;
+  }
+
+  auto precomp_cost = [&](uint64_t precomp_layers) {
+    uint64_t cost = 0;
+    for (auto &region : regions) {
+      uint64_t ids = region.id_set.getBits() & precomp_layers;
+      if (!ids)
+        continue;
+      uint64_t pixel_cost = 1;
+      for (size_t i = 0; ids; ++i, ids >>= 1)
+        if (ids & 1)
+          pixel_cost += sample_costs[i];
+      cost += (uint64_t)region.rect.area() * pixel_cost;
+    }
+    return cost;
+  };
+
+  bool have_precomp = GetPrecomp(composition) != NULL;
+  std::vector<DrmPlane *> avail_planes;
+  auto is_valid_plan = [&](uint64_t dedicated) {
+    uint64_t precomp_layers = all_layers & ~dedicated;
+    avail_planes.assign(planes->begin(), planes->end());
+    if (precomp_layers && !have_precomp) {
+      if (avail_planes.empty())
+        return false;
+      avail_planes.pop_back();
+    }
+
+    for (size_t i = 0; i < num_layers; ++i) {
+      if (!(dedicated & ((uint64_t)1 << i)))
+        continue;
+
+      // The precomp plane sits on top, so lower precomposited layers must not
+      // show through this one
+      uint64_t below = ((uint64_t)1 << i) - 1;
+      if ((overlaps[i] & precomp_layers & below) &&
+          !LayerIsOpaque(stack[i].second))
+        return false;
+
+      if (!PopPlane(&avail_planes, stack[i].second))
+        return false;
+    }
+    return true;
+  };
+
+  // Candidates for dedicated planes, most expensive to precomposite first
+  std::vector<size_t> candidates(num_layers);
+  std::vector<uint64_t> layer_costs(num_layers);
+  for (size_t i = 0; i < num_layers; ++i) {
+    candidates[i] = i;
+    layer_costs[i] = precomp_cost((uint64_t)1 << i);
+  }
+  std::stable_sort(candidates.begin(), candidates.end(),
+                   [&](size_t a, size_t b) {
+    return layer_costs[a] > layer_costs[b];
+  });
+  if (candidates.size() > kMaxCandidateLayers)
+    candidates.resize(kMaxCandidateLayers);
+
+  // Try every subset of the candidates which fits in the available planes,
+  // preferring fewer planes when the cost is the same
+  bool found = false;
+  uint64_t best_plan = 0;
+  uint64_t best_cost = 0;
+  size_t best_planes = 0;
+  size_t num_subsets = (size_t)1 << candidates.size();
+  for (size_t subset = 0; subset < num_subsets; ++subset) {
+    size_t num_dedicated = __builtin_popcountll(subset);
+    if (num_dedicated > planes->size())
+      continue;
+
+    uint64_t dedicated = 0;
+    for (size_t i = 0; i < candidates.size(); ++i)
+      if (subset & ((size_t)1 << i))
+        dedicated |= (uint64_t)1 << candidates[i];
+    if (!is_valid_plan(dedicated))
+      continue;
+
+    uint64_t cost = precomp_cost(all_layers & ~dedicated);
+    if (!found || cost < best_cost ||
+        (cost == best_cost && num_dedicated < best_planes)) {
+      found = true;
+      best_plan = dedicated;
+      best_cost = cost;
+      best_planes = num_dedicated;
+    }
+  }
+
+  if (!found) {
+    PlanStageGreedy greedy;
+    return greedy.ProvisionPlanes(composition, layers, crtc, planes);
   }
 
-  // Put the rest of the layers in the precomp plane
   DrmCompositionPlane *precomp = GetPrecomp(composition);
-  if (precomp) {
-    for (auto i = layers.begin(); i != layers.end(); i = layers.erase(i))
-      precomp->source_layers().emplace_back(i->first);
+  if (!precomp && (all_layers & ~best_plan)) {
+    DrmPlane *precomp_plane = planes->back();
+    planes->pop_back();
+    composition->emplace_back(DrmCompositionPlane::Type::kPrecomp,
+                              precomp_plane, crtc);
+    precomp = &composition->back();
   }
 
+  for (size_t i = 0; i < num_layers; ++i) {
+    if (!(best_plan & ((uint64_t)1 << i)))
+      continue;
+    int ret = Emplace(composition, planes, DrmCompositionPlane::Type::kLayer,
+                      crtc, stack[i]);
+    if (ret)
+      ALOGE("Failed to emplace layer %zu, dropping it", stack[i].first);
+  }
+
+  // Emplace may have moved the precomp plane around
+  precomp = GetPrecomp(composition);
+  for (size_t i = 0; i < num_layers; ++i)
+    if (precomp && !(best_plan & ((uint64_t)1 << i)))
+      precomp->source_layers().emplace_back(stack[i].first);
+  layers.clear();
+
   return 0;
 }
 }
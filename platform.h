@@ -53,6 +53,19 @@ class Importer {
   // Note: This can be called from a different thread than ImportBuffer. The
   //       implementation is responsible for ensuring thread safety.
   virtual int ReleaseBuffer(hwc_drm_bo_t *bo) = 0;
+
+  // Drops any import of the buffer referred to by handle which the importer
+  // has cached across ReleaseBuffer calls. Buffers still referenced by a
+  // composition are dropped once their last reference is released.
+  virtual void ReleaseCachedBuffer(buffer_handle_t /*handle*/) {
+  }
+
+  // Returns an identifier of the memory behind handle that stays the same for
+  // every handle referring to it while the buffer is alive, or 0 if the
+  // importer can't tell buffers apart.
+  virtual uint64_t GetBufferId(buffer_handle_t /*handle*/) {
+    return 0;
+  }
 };
 
 class Planner {
@@ -77,7 +90,25 @@ class Planner {
       return plane;
     }
 
-    // Finds and returns the squash layer from the composition
+    // Removes and returns the next available plane from planes which can scan
+    // out layer. Planes are ordered by z-order and layers are provisioned
+    // bottom up, so the incompatible planes skipped on the way are removed as
+    // well. If no plane fits, planes is left untouched.
+    static DrmPlane *PopPlane(std::vector<DrmPlane *> *planes,
+                              DrmHwcLayer *layer) {
+      auto plane = std::find_if(planes->begin(), planes->end(),
+                                [layer](DrmPlane *p) {
+        return p->IsValidForLayer(layer);
+      });
+      if (plane == planes->end())
+        return NULL;
+      DrmPlane *ret = *plane;
+      planes->erase(planes->begin(), plane + 1);
+      return ret;
+    }
+
+    // Finds and returns the topmost precomp plane of the composition, which
+    // takes the layers that can't go anywhere else
     static DrmCompositionPlane *GetPrecomp(
         std::vector<DrmCompositionPlane> *composition) {
       auto l = GetPrecompIter(composition);
@@ -86,8 +117,8 @@ class Planner {
       return &(*l);
     }
 
-    // Inserts the given layer:plane in the composition right before the precomp
-    // layer
+    // Inserts the given layer:plane in the composition right before the topmost
+    // precomp layer
     static int Emplace(std::vector<DrmCompositionPlane> *composition,
                        std::vector<DrmPlane *> *planes,
                        DrmCompositionPlane::Type type, DrmCrtc *crtc,
@@ -101,13 +132,29 @@ class Planner {
       return 0;
     }
 
-   private:
+    // Same as above, but only considers planes which can scan out the layer
+    static int Emplace(std::vector<DrmCompositionPlane> *composition,
+                       std::vector<DrmPlane *> *planes,
+                       DrmCompositionPlane::Type type, DrmCrtc *crtc,
+                       std::pair<size_t, DrmHwcLayer *> layer) {
+      DrmPlane *plane = PopPlane(planes, layer.second);
+      if (!plane)
+        return -ENOENT;
+
+      auto precomp = GetPrecompIter(composition);
+      composition->emplace(precomp, type, plane, crtc, layer.first);
+      return 0;
+    }
+
     static std::vector<DrmCompositionPlane>::iterator GetPrecompIter(
         std::vector<DrmCompositionPlane> *composition) {
-      return std::find_if(composition->begin(), composition->end(),
-                          [](const DrmCompositionPlane &p) {
+      auto precomp = std::find_if(composition->rbegin(), composition->rend(),
+                                  [](const DrmCompositionPlane &p) {
         return p.type() == DrmCompositionPlane::Type::kPrecomp;
       });
+      if (precomp == composition->rend())
+        return composition->end();
+      return std::prev(precomp.base());
     }
   };
 
@@ -116,10 +163,12 @@ class Planner {
 
   // Takes a stack of layers and provisions hardware planes for them. If the
   // entire stack can't fit in hardware, the Planner may place the remaining
-  // layers in a PRECOMP plane. Layers in the PRECOMP plane will be composited
-  // using GL. PRECOMP planes should be placed above any 1:1 layer:plane
-  // compositions. If use_squash_fb is true, the Planner should try to reserve a
-  // plane at the highest z-order with type SQUASH.
+  // layers in PRECOMP planes. Layers in PRECOMP planes will be composited
+  // using GL. The topmost PRECOMP plane should be placed above any 1:1
+  // layer:plane compositions, unless the planes support zpos (see
+  // AssignZpos). Further PRECOMP planes hold layers between dedicated ones.
+  // If use_squash_fb is true, the Planner should try to reserve a plane at
+  // the highest z-order with type SQUASH.
   //
   // @layers: a map of index:layer of layers to composite
   // @use_squash_fb: reserve a squash framebuffer
@@ -133,18 +182,44 @@ class Planner {
       DrmCrtc *crtc, std::vector<DrmPlane *> *primary_planes,
       std::vector<DrmPlane *> *overlay_planes);
 
+  // Reorders the composition bottom to top and assigns each enabled plane a
+  // zpos, provided all of them have a zpos property. Dedicated layers
+  // above every layer in the precomp plane are then stacked above it, so they
+  // no longer need a hole punched through the precomposition. If the planes'
+  // zpos ranges don't allow the reordering, the planes keep their order.
+  static void AssignZpos(std::vector<DrmCompositionPlane> *composition);
+
+  // The plan of the previous frame. DrmDisplayComposition::Plan reuses it
+  // as long as the fingerprint of everything that affects planning matches.
+  struct CachedPlan {
+    std::vector<uint64_t> fingerprint;
+    std::vector<DrmCompositionPlane> composition_planes;
+    std::vector<DrmCompositionRegion> pre_comp_regions;
+  };
+
+  CachedPlan *cached_plan() {
+    return &cached_plan_;
+  }
+
   template <typename T, typename... A>
   void AddStage(A &&... args) {
     stages_.emplace_back(
-        std::unique_ptr<PlanStage>(new T(std::forward(args)...)));
+        std::unique_ptr<PlanStage>(new T(std::forward<A>(args)...)));
   }
 
+  // Adds the stages provisioning planes for the layers left over by previous
+  // stages, PlanStageGreedy or PlanStageCost as selected by hwc.drm.planner
+  // ("greedy" or "cost"), along with PlanStagePrecomp where needed. The greedy
+  // stage uses up to hwc.drm.max_precomp_planes precomp planes.
+  void AddProvisioningStage();
+
  private:
   std::vector<DrmPlane *> GetUsablePlanes(
       DrmCrtc *crtc, std::vector<DrmPlane *> *primary_planes,
       std::vector<DrmPlane *> *overlay_planes);
 
   std::vector<std::unique_ptr<PlanStage>> stages_;
+  CachedPlan cached_plan_;
 };
 
 // This plan stage extracts all protected layers and places them on dedicated
@@ -157,9 +232,9 @@ class PlanStageProtected : public Planner::PlanStage {
 };
 
 // This plan stage provisions the precomp plane with any remaining layers that
-// are on top of the current precomp layers. This stage should be included in
-// all platforms before loosely allocating layers (i.e. PlanStageGreedy) if
-// any previous plan could have modified the precomp plane layers
+// are on top of the current precomp layers. Planner::AddProvisioningStage
+// includes it for provisioning stages which only use a single precomp plane,
+// since any previous plan could have modified the precomp plane layers
 // (ex. PlanStageProtected).
 class PlanStagePrecomp : public Planner::PlanStage {
  public:
@@ -170,12 +245,69 @@ class PlanStagePrecomp : public Planner::PlanStage {
 
 // This plan stage places as many layers on dedicated planes as possible (first
 // come first serve), and then sticks the rest in a precomposition plane (if
-// needed).
+// needed). With more than one precomp plane allowed, layers which can't go on
+// a plane of their own, including those earlier stages put in the precomp
+// plane, are precomposited on a plane at their own position in the stack, so
+// that the layers above them can still get dedicated planes.
 class PlanStageGreedy : public Planner::PlanStage {
+ public:
+  explicit PlanStageGreedy(unsigned max_precomp_planes = 1)
+      : max_precomp_planes_(max_precomp_planes) {
+  }
+
+  int ProvisionPlanes(std::vector<DrmCompositionPlane> *composition,
+                      std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
+                      std::vector<DrmPlane *> *planes);
+
+ private:
+  unsigned max_precomp_planes_;
+};
+
+// Places the topmost layer on a cursor plane if it's a cursor layer. The
+// Planner runs this stage on the cursor planes before any other, which only
+// ever see the remaining planes.
+class PlanStageCursor : public Planner::PlanStage {
+ public:
+  int ProvisionPlanes(std::vector<DrmCompositionPlane> *composition,
+                      std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
+                      std::vector<DrmPlane *> *planes);
+};
+
+// This plan stage enforces the limits of scalers shared between planes (see
+// DrmPlaneScalingLimits). If more layers need scaling than there are scalers
+// for, the topmost scaled layers are put in the precomposition plane. The
+// limits of each plane's own scaler are checked whenever a layer is placed on
+// it. The provisioning stage takes care of the z-order of the layers above the
+// precomposited ones.
+class PlanStageScalingLimits : public Planner::PlanStage {
+ public:
+  int ProvisionPlanes(std::vector<DrmCompositionPlane> *composition,
+                      std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
+                      std::vector<DrmPlane *> *planes);
+
+  // Gives every plane the limits set through hwc.drm.plane_max_upscale,
+  // hwc.drm.plane_max_downscale and hwc.drm.plane_min_src_size, for platforms
+  // without a table of their own.
+  static void SetLimitsFromProperties(DrmResources *drm);
+};
+
+// This plan stage picks the layers to put on dedicated planes such that the
+// estimated GL cost of the precomposition is the lowest, and sticks the rest in
+// a precomposition plane (if needed). The estimate counts each pixel written to
+// the precomp buffer plus each layer pixel sampled, the latter weighted by
+// format conversion and scaling. Layers may go on a plane below the precomp
+// plane even if lower layers are precomposited, as long as they are opaque or
+// don't overlap them.
+class PlanStageCost : public Planner::PlanStage {
  public:
   int ProvisionPlanes(std::vector<DrmCompositionPlane> *composition,
                       std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
                       std::vector<DrmPlane *> *planes);
+
+ private:
+  // Only the most expensive layers are considered for dedicated planes, which
+  // bounds the search to a few hundred candidate plans.
+  static const size_t kMaxCandidateLayers = 10;
 };
 }
 #endif
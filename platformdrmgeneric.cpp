@@ -16,21 +16,44 @@
 
 #define LOG_TAG "hwc-platform-drm-generic"
 
+#include "autolock.h"
 #include "drmresources.h"
 #include "platform.h"
 #include "platformdrmgeneric.h"
 
+#include <stdlib.h>
+#include <sys/stat.h>
+
 #include <drm/drm_fourcc.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include <cutils/properties.h>
 #include <log/log.h>
 #include <gralloc_handle.h>
 #include <hardware/gralloc.h>
 #include <EGL/eglext.h>
 
+#include <vector>
+
+#ifndef EGL_EXT_image_dma_buf_import_modifiers
+#define EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT 0x3443
+#define EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT 0x3444
+#define EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT 0x3445
+#define EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT 0x3446
+#define EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT 0x3447
+#define EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT 0x3448
+#endif
+
 namespace android {
 
+// Modifiers are only passed along when the buffer isn't plain linear, so that
+// kernels and EGL stacks without modifier support keep working.
+static bool HasModifiers(const hwc_drm_bo_t &bo) {
+  return bo.modifiers[0] != DRM_FORMAT_MOD_LINEAR &&
+         bo.modifiers[0] != DRM_FORMAT_MOD_INVALID;
+}
+
 #ifdef USE_DRM_GENERIC_IMPORTER
 // static
 Importer *Importer::CreateInstance(DrmResources *drm) {
@@ -49,9 +72,14 @@ Importer *Importer::CreateInstance(DrmResources *drm) {
 #endif
 
 DrmGenericImporter::DrmGenericImporter(DrmResources *drm) : drm_(drm) {
+  pthread_mutex_init(&cache_lock_, NULL);
 }
 
 DrmGenericImporter::~DrmGenericImporter() {
+  for (auto &entry : buffer_cache_)
+    ReleaseBufferImpl(&entry.second.bo);
+  buffer_cache_.clear();
+  pthread_mutex_destroy(&cache_lock_);
 }
 
 int DrmGenericImporter::Init() {
@@ -61,6 +89,10 @@ int DrmGenericImporter::Init() {
     ALOGE("Failed to open gralloc module");
     return ret;
   }
+
+  char cache_size_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.fb_cache_size", cache_size_prop, "16");
+  max_idle_buffers_ = strtoul(cache_size_prop, NULL, 10);
   return 0;
 }
 
@@ -78,6 +110,10 @@ uint32_t DrmGenericImporter::ConvertHalFormatToDrm(uint32_t hal_format) {
       return DRM_FORMAT_BGR565;
     case HAL_PIXEL_FORMAT_YV12:
       return DRM_FORMAT_YVU420;
+    case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+      return DRM_FORMAT_NV21;
+    case HAL_PIXEL_FORMAT_YCbCr_422_SP:
+      return DRM_FORMAT_NV16;
     default:
       ALOGE("Cannot convert hal format to drm format %u", hal_format);
       return -EINVAL;
@@ -85,32 +121,75 @@ uint32_t DrmGenericImporter::ConvertHalFormatToDrm(uint32_t hal_format) {
 }
 
 EGLImageKHR DrmGenericImporter::ImportImage(EGLDisplay egl_display, buffer_handle_t handle) {
-  gralloc_handle_t *gr_handle = gralloc_handle(handle);
-  if (!gr_handle)
+  hwc_drm_bo_t layout;
+  int prime_fd;
+  if (GetBufferLayout(handle, &layout, &prime_fd))
     return NULL;
-  EGLint attr[] = {
-    EGL_WIDTH, (EGLint)gr_handle->width,
-    EGL_HEIGHT, (EGLint)gr_handle->height,
-    EGL_LINUX_DRM_FOURCC_EXT, (EGLint)ConvertHalFormatToDrm(gr_handle->format),
-    EGL_DMA_BUF_PLANE0_FD_EXT, gr_handle->prime_fd,
-    EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
-    EGL_DMA_BUF_PLANE0_PITCH_EXT, (EGLint)gr_handle->stride,
-    EGL_NONE,
+
+  static const EGLint plane_attrs[][5] = {
+      {EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT,
+       EGL_DMA_BUF_PLANE0_PITCH_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+       EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT},
+      {EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+       EGL_DMA_BUF_PLANE1_PITCH_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+       EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT},
+      {EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT,
+       EGL_DMA_BUF_PLANE2_PITCH_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
+       EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT},
   };
-  return eglCreateImageKHR(egl_display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attr);
+
+  std::vector<EGLint> attr = {
+    EGL_WIDTH, (EGLint)layout.width,
+    EGL_HEIGHT, (EGLint)layout.height,
+    EGL_LINUX_DRM_FOURCC_EXT, (EGLint)layout.format,
+  };
+  for (int i = 0; i < 3 && layout.pitches[i]; i++) {
+    attr.insert(attr.end(), {plane_attrs[i][0], prime_fd,
+                             plane_attrs[i][1], (EGLint)layout.offsets[i],
+                             plane_attrs[i][2], (EGLint)layout.pitches[i]});
+    if (HasModifiers(layout))
+      attr.insert(attr.end(), {plane_attrs[i][3],
+                               (EGLint)(layout.modifiers[i] & 0xffffffff),
+                               plane_attrs[i][4],
+                               (EGLint)(layout.modifiers[i] >> 32)});
+  }
+  attr.push_back(EGL_NONE);
+  return eglCreateImageKHR(egl_display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attr.data());
 }
 
-int DrmGenericImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
-  gralloc_handle_t *gr_handle = gralloc_handle(handle);
-  if (!gr_handle)
+// static
+int DrmGenericImporter::SetupPlanes(hwc_drm_bo_t *bo) {
+  if (bo->format == (uint32_t)-EINVAL)
     return -EINVAL;
 
-  uint32_t gem_handle;
-  int ret = drmPrimeFDToHandle(drm_->fd(), gr_handle->prime_fd, &gem_handle);
-  if (ret) {
-    ALOGE("failed to import prime fd %d ret=%d", gr_handle->prime_fd, ret);
-    return ret;
+  // The chroma planes follow the luma plane the way system/graphics.h
+  // documents.
+  uint32_t luma_size = bo->pitches[0] * bo->height;
+  switch (bo->format) {
+    case DRM_FORMAT_YVU420:
+      bo->pitches[1] = bo->pitches[2] = ((bo->pitches[0] / 2) + 15) & ~15;
+      bo->offsets[1] = bo->offsets[0] + luma_size;
+      bo->offsets[2] =
+          bo->offsets[1] + bo->pitches[1] * ((bo->height + 1) / 2);
+      bo->modifiers[1] = bo->modifiers[2] = bo->modifiers[0];
+      break;
+    case DRM_FORMAT_NV21:
+    case DRM_FORMAT_NV16:
+      bo->pitches[1] = bo->pitches[0];
+      bo->offsets[1] = bo->offsets[0] + luma_size;
+      bo->modifiers[1] = bo->modifiers[0];
+      break;
+    default:
+      break;
   }
+  return 0;
+}
+
+int DrmGenericImporter::GetBufferLayout(buffer_handle_t handle,
+                                        hwc_drm_bo_t *bo, int *prime_fd) {
+  gralloc_handle_t *gr_handle = gralloc_handle(handle);
+  if (!gr_handle)
+    return -EINVAL;
 
   memset(bo, 0, sizeof(hwc_drm_bo_t));
   bo->width = gr_handle->width;
@@ -118,45 +197,236 @@ int DrmGenericImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   bo->format = ConvertHalFormatToDrm(gr_handle->format);
   bo->usage = gr_handle->usage;
   bo->pitches[0] = gr_handle->stride;
-  bo->gem_handles[0] = gem_handle;
   bo->offsets[0] = 0;
+  bo->modifiers[0] = gr_handle->modifier;
 
-  ret = drmModeAddFB2(drm_->fd(), bo->width, bo->height, bo->format,
-                      bo->gem_handles, bo->pitches, bo->offsets, &bo->fb_id, 0);
+  *prime_fd = gr_handle->prime_fd;
+  return SetupPlanes(bo);
+}
+
+static bool SameBufferLayout(const hwc_drm_bo_t &a, const hwc_drm_bo_t &b) {
+  return a.width == b.width && a.height == b.height && a.format == b.format &&
+         !memcmp(a.pitches, b.pitches, sizeof(a.pitches)) &&
+         !memcmp(a.offsets, b.offsets, sizeof(a.offsets)) &&
+         !memcmp(a.modifiers, b.modifiers, sizeof(a.modifiers));
+}
+
+int DrmGenericImporter::ImportPrimeFd(int prime_fd, hwc_drm_bo_t *bo) {
+  uint32_t gem_handle;
+  int ret = drm_->ImportGemHandle(prime_fd, &gem_handle);
+  if (ret)
+    return ret;
+
+  int num_gem_handles = sizeof(bo->gem_handles) / sizeof(bo->gem_handles[0]);
+  for (int i = 0; i < num_gem_handles; i++)
+    bo->gem_handles[i] = bo->pitches[i] ? gem_handle : 0;
+
+  if (HasModifiers(*bo))
+    ret = drmModeAddFB2WithModifiers(drm_->fd(), bo->width, bo->height,
+                                     bo->format, bo->gem_handles, bo->pitches,
+                                     bo->offsets, bo->modifiers, &bo->fb_id,
+                                     DRM_MODE_FB_MODIFIERS);
+  else
+    ret = drmModeAddFB2(drm_->fd(), bo->width, bo->height, bo->format,
+                        bo->gem_handles, bo->pitches, bo->offsets, &bo->fb_id,
+                        0);
   if (ret) {
     ALOGE("could not create drm fb %d", ret);
+    ReleaseBufferImpl(bo);
     return ret;
   }
 
   return ret;
 }
 
-int DrmGenericImporter::ReleaseBuffer(hwc_drm_bo_t *bo) {
-  if (bo->fb_id)
-    if (drmModeRmFB(drm_->fd(), bo->fb_id))
-      ALOGE("Failed to rm fb");
+bool DrmGenericImporter::UseBufferCache(int prime_fd) {
+  // Importers may run on the import worker and the compositor concurrently
+  AutoLock lock(&cache_lock_, "importer");
+  if (lock.Lock())
+    return false;
 
-  struct drm_gem_close gem_close;
-  memset(&gem_close, 0, sizeof(gem_close));
-  int num_gem_handles = sizeof(bo->gem_handles) / sizeof(bo->gem_handles[0]);
-  for (int i = 0; i < num_gem_handles; i++) {
-    if (!bo->gem_handles[i])
-      continue;
+  if (cache_checked_)
+    return cache_enabled_;
+
+  // Kernels before 5.3 back every dma-buf with the same anonymous inode, so
+  // the inode can't be used to tell buffers apart there.
+  char path[32];
+  char link[64] = {0};
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", prime_fd);
+  ssize_t len = readlink(path, link, sizeof(link) - 1);
+  cache_enabled_ = len > 0 && strncmp(link, "anon_inode:", 11);
+  cache_checked_ = true;
+  if (!cache_enabled_)
+    ALOGW("dma-buf inodes are not unique, disabling framebuffer cache");
+  return cache_enabled_;
+}
+
+ino_t DrmGenericImporter::GetBufferKey(int prime_fd) {
+  struct stat st;
+  if (!UseBufferCache(prime_fd) || fstat(prime_fd, &st))
+    return 0;
+  return st.st_ino;
+}
 
-    gem_close.handle = bo->gem_handles[i];
-    int ret = drmIoctl(drm_->fd(), DRM_IOCTL_GEM_CLOSE, &gem_close);
+uint64_t DrmGenericImporter::GetBufferId(buffer_handle_t handle) {
+  hwc_drm_bo_t layout;
+  int prime_fd;
+  if (GetBufferLayout(handle, &layout, &prime_fd))
+    return 0;
+  return GetBufferKey(prime_fd);
+}
+
+int DrmGenericImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
+  hwc_drm_bo_t layout;
+  int prime_fd;
+  int ret = GetBufferLayout(handle, &layout, &prime_fd);
+  if (ret)
+    return ret;
+
+  ino_t key = GetBufferKey(prime_fd);
+  if (!key) {
+    ret = ImportPrimeFd(prime_fd, &layout);
     if (ret)
-      ALOGE("Failed to close gem handle %d %d", i, ret);
-    else
-      bo->gem_handles[i] = 0;
+      return ret;
+    *bo = layout;
+    return 0;
+  }
+
+  AutoLock lock(&cache_lock_, "importer");
+  ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  auto cached = buffer_cache_.find(key);
+  if (cached != buffer_cache_.end()) {
+    CachedBuffer &entry = cached->second;
+    if (!entry.evict && SameBufferLayout(entry.bo, layout)) {
+      if (!entry.refs++)
+        --idle_buffers_;
+      *bo = entry.bo;
+      bo->usage = layout.usage;
+      return 0;
+    }
+
+    // The buffer has been reinterpreted (or is on its way out), we can only
+    // replace the cached import once nobody is scanning out of it anymore.
+    if (!entry.refs) {
+      ReleaseBufferImpl(&entry.bo);
+      --idle_buffers_;
+      buffer_cache_.erase(cached);
+    } else {
+      ret = ImportPrimeFd(prime_fd, &layout);
+      if (ret)
+        return ret;
+      *bo = layout;
+      return 0;
+    }
+  }
+
+  ret = ImportPrimeFd(prime_fd, &layout);
+  if (ret)
+    return ret;
+
+  CachedBuffer &entry = buffer_cache_[key];
+  entry.key = key;
+  entry.refs = 1;
+  entry.bo = layout;
+  entry.bo.priv = &entry;
+  *bo = entry.bo;
+  return 0;
+}
+
+void DrmGenericImporter::ReleaseBufferImpl(hwc_drm_bo_t *bo) {
+  drm_->buffer_reaper()->QueueRelease(bo);
+}
+
+void DrmGenericImporter::EvictIdleBuffers() {
+  while (idle_buffers_ > max_idle_buffers_) {
+    auto oldest = buffer_cache_.end();
+    for (auto it = buffer_cache_.begin(); it != buffer_cache_.end(); ++it) {
+      if (it->second.refs)
+        continue;
+      if (oldest == buffer_cache_.end() ||
+          it->second.last_release < oldest->second.last_release)
+        oldest = it;
+    }
+    if (oldest == buffer_cache_.end())
+      break;
+
+    ReleaseBufferImpl(&oldest->second.bo);
+    buffer_cache_.erase(oldest);
+    --idle_buffers_;
+  }
+}
+
+int DrmGenericImporter::ReleaseBuffer(hwc_drm_bo_t *bo) {
+  if (!bo->priv) {
+    ReleaseBufferImpl(bo);
+    return 0;
+  }
+
+  AutoLock lock(&cache_lock_, "importer");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  CachedBuffer *entry = static_cast<CachedBuffer *>(bo->priv);
+  bo->priv = NULL;
+  if (!entry->refs) {
+    ALOGE("Unbalanced release of cached fb %d", entry->bo.fb_id);
+    return -EINVAL;
+  }
+
+  if (--entry->refs)
+    return 0;
+
+  if (entry->evict) {
+    ReleaseBufferImpl(&entry->bo);
+    buffer_cache_.erase(entry->key);
+    return 0;
   }
+
+  entry->last_release = ++release_count_;
+  ++idle_buffers_;
+  EvictIdleBuffers();
   return 0;
 }
 
+void DrmGenericImporter::ReleaseCachedBuffer(buffer_handle_t handle) {
+  hwc_drm_bo_t layout;
+  int prime_fd;
+  if (GetBufferLayout(handle, &layout, &prime_fd))
+    return;
+
+  ino_t key = GetBufferKey(prime_fd);
+  if (!key)
+    return;
+
+  AutoLock lock(&cache_lock_, "importer");
+  if (lock.Lock())
+    return;
+
+  auto cached = buffer_cache_.find(key);
+  if (cached == buffer_cache_.end())
+    return;
+
+  if (cached->second.refs) {
+    cached->second.evict = true;
+    return;
+  }
+
+  ReleaseBufferImpl(&cached->second.bo);
+  buffer_cache_.erase(cached);
+  --idle_buffers_;
+}
+
 #ifdef USE_DRM_GENERIC_IMPORTER
-std::unique_ptr<Planner> Planner::CreateInstance(DrmResources *) {
+std::unique_ptr<Planner> Planner::CreateInstance(DrmResources *drm) {
+  PlanStageScalingLimits::SetLimitsFromProperties(drm);
+
   std::unique_ptr<Planner> planner(new Planner);
-  planner->AddStage<PlanStageGreedy>();
+  planner->AddStage<PlanStageScalingLimits>();
+  planner->AddProvisioningStage();
   return planner;
 }
 #endif
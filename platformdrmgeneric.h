@@ -22,6 +22,11 @@
 
 #include <hardware/gralloc.h>
 
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <map>
+
 namespace android {
 
 class DrmGenericImporter : public Importer {
@@ -34,13 +39,54 @@ class DrmGenericImporter : public Importer {
   EGLImageKHR ImportImage(EGLDisplay egl_display, buffer_handle_t handle) override;
   int ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) override;
   int ReleaseBuffer(hwc_drm_bo_t *bo) override;
+  void ReleaseCachedBuffer(buffer_handle_t handle) override;
+  uint64_t GetBufferId(buffer_handle_t handle) override;
 
   uint32_t ConvertHalFormatToDrm(uint32_t hal_format);
+
+ protected:
+  // Fills in the size, format, usage, pitches and offsets of bo from the
+  // gralloc handle and returns the dma-buf fd backing it in prime_fd. The
+  // gem_handles and fb_id are left for ImportBuffer to fill in.
+  virtual int GetBufferLayout(buffer_handle_t handle, hwc_drm_bo_t *bo,
+                              int *prime_fd);
+
+  // Fills in the pitches and offsets of the chroma planes of bo for
+  // multi-planar formats, given the format, height and the luma plane layout.
+  static int SetupPlanes(hwc_drm_bo_t *bo);
+
  private:
+  // Number of imported buffers no longer referenced by any composition that
+  // we keep around in case they come back (ie: BufferQueue recycling).
+  static const unsigned kDefaultMaxIdleBuffers = 16;
+
+  struct CachedBuffer {
+    hwc_drm_bo_t bo;
+    ino_t key;
+    unsigned refs = 0;
+    uint64_t last_release = 0;
+    bool evict = false;
+  };
+
+  bool UseBufferCache(int prime_fd);
+  ino_t GetBufferKey(int prime_fd);
+  int ImportPrimeFd(int prime_fd, hwc_drm_bo_t *bo);
+  void ReleaseBufferImpl(hwc_drm_bo_t *bo);
+  void EvictIdleBuffers();
 
   DrmResources *drm_;
 
   const gralloc_module_t *gralloc_;
+
+  // Imported buffers keyed by the inode of their dma-buf, which stays unique
+  // for as long as we hold a gem handle to it
+  pthread_mutex_t cache_lock_;
+  bool cache_checked_ = false;
+  bool cache_enabled_ = false;
+  std::map<ino_t, CachedBuffer> buffer_cache_;
+  unsigned max_idle_buffers_ = kDefaultMaxIdleBuffers;
+  unsigned idle_buffers_ = 0;
+  uint64_t release_count_ = 0;
 };
 }
 
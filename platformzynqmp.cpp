@@ -70,39 +70,12 @@ int ZynqmpImporter::Init() {
   return 0;
 }
 
-EGLImageKHR ZynqmpImporter::ImportImage(EGLDisplay egl_display, buffer_handle_t handle) {
-  private_handle_t const *hnd = reinterpret_cast < private_handle_t const *>(handle);
-  if (!hnd)
-    return NULL;
-
-  EGLint fmt = ConvertHalFormatToDrm(hnd->format);
-  if (fmt < 0)
-	return NULL;
-
-  EGLint attr[] = {
-    EGL_WIDTH, hnd->width,
-    EGL_HEIGHT, hnd->height,
-    EGL_LINUX_DRM_FOURCC_EXT, fmt,
-    EGL_DMA_BUF_PLANE0_FD_EXT, hnd->share_fd,
-    EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
-    EGL_DMA_BUF_PLANE0_PITCH_EXT, hnd->byte_stride,
-    EGL_NONE,
-  };
-  return eglCreateImageKHR(egl_display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attr);
-}
-
-int ZynqmpImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
+int ZynqmpImporter::GetBufferLayout(buffer_handle_t handle, hwc_drm_bo_t *bo,
+                                    int *prime_fd) {
   private_handle_t const *hnd = reinterpret_cast < private_handle_t const *>(handle);
   if (!hnd)
     return -EINVAL;
 
-  uint32_t gem_handle;
-  int ret = drmPrimeFDToHandle(drm_->fd(), hnd->share_fd, &gem_handle);
-  if (ret) {
-    ALOGE("failed to import prime fd %d ret=%d", hnd->share_fd, ret);
-    return ret;
-  }
-
   EGLint fmt = ConvertHalFormatToDrm(hnd->format);
   if (fmt < 0)
 	return fmt;
@@ -113,22 +86,23 @@ int ZynqmpImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   bo->format = fmt;
   bo->usage = hnd->usage;
   bo->pitches[0] = hnd->byte_stride;
-  bo->gem_handles[0] = gem_handle;
-  bo->offsets[0] = 0;
-
-  ret = drmModeAddFB2(drm_->fd(), bo->width, bo->height, bo->format,
-                      bo->gem_handles, bo->pitches, bo->offsets, &bo->fb_id, 0);
-  if (ret) {
-    ALOGE("could not create drm fb %d", ret);
-    return ret;
-  }
+  // The buffer may start part way into the dma-buf (ie: the framebuffer)
+  bo->offsets[0] = hnd->offset;
 
-  return ret;
+  *prime_fd = hnd->share_fd;
+  return SetupPlanes(bo);
 }
 
-std::unique_ptr<Planner> Planner::CreateInstance(DrmResources *) {
+std::unique_ptr<Planner> Planner::CreateInstance(DrmResources *drm) {
+  // The DisplayPort subsystem planes can't scale
+  DrmPlaneScalingLimits limits;
+  limits.max_upscale = limits.max_downscale = 1.0f;
+  for (auto &plane : drm->planes())
+    plane->set_scaling_limits(limits);
+
   std::unique_ptr<Planner> planner(new Planner);
-  planner->AddStage<PlanStageGreedy>();
+  planner->AddStage<PlanStageScalingLimits>();
+  planner->AddProvisioningStage();
   return planner;
 }
 }
@@ -35,8 +35,9 @@ class ZynqmpImporter : public DrmGenericImporter {
 
   int Init();
 
-  EGLImageKHR ImportImage(EGLDisplay egl_display, buffer_handle_t handle) override;
-  int ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) override;
+ protected:
+  int GetBufferLayout(buffer_handle_t handle, hwc_drm_bo_t *bo,
+                      int *prime_fd) override;
 
  private:
 
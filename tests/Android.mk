@@ -3,6 +3,8 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
+	drmpropertyset_test.cpp \
+	planearbiter_test.cpp \
 	separate_rects_test.cpp \
 	worker_test.cpp
 
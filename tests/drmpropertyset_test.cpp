@@ -0,0 +1,64 @@
+#include <gtest/gtest.h>
+
+#include "drmpropertyset.h"
+
+using android::DrmPropertySet;
+
+struct DrmPropertySetTest : public testing::Test {
+  DrmPropertySet pset;
+
+  virtual void SetUp() {
+    ASSERT_EQ(0, pset.Begin());
+    ASSERT_EQ(0, pset.Add(1, 2, 3));
+    ASSERT_EQ(0, pset.Add(1, 4, 5));
+    ASSERT_EQ(0, pset.Add(6, 2, 7));
+    pset.Committed();
+    ASSERT_EQ(0, pset.Begin());
+  }
+};
+
+TEST_F(DrmPropertySetTest, add_before_begin_fails) {
+  DrmPropertySet fresh;
+  ASSERT_NE(0, fresh.Add(1, 2, 3));
+}
+
+TEST_F(DrmPropertySetTest, unchanged_values_are_skipped) {
+  ASSERT_TRUE(pset.IsCommitted(1, 2, 3));
+  ASSERT_EQ(0, pset.Add(1, 2, 3));
+  ASSERT_EQ(0, pset.Add(6, 2, 7));
+  ASSERT_EQ(0u, pset.size());
+
+  ASSERT_EQ(0, pset.Add(1, 2, 8));
+  ASSERT_EQ(1u, pset.size());
+}
+
+TEST_F(DrmPropertySetTest, forced_values_are_sent) {
+  ASSERT_EQ(0, pset.Add(1, 2, 3, true));
+  ASSERT_EQ(1u, pset.size());
+}
+
+TEST_F(DrmPropertySetTest, forget_drops_only_that_object) {
+  pset.Forget(1);
+  ASSERT_FALSE(pset.IsCommitted(1, 2, 3));
+  ASSERT_FALSE(pset.IsCommitted(1, 4, 5));
+  ASSERT_TRUE(pset.IsCommitted(6, 2, 7));
+
+  ASSERT_EQ(0, pset.Add(1, 2, 3));
+  ASSERT_EQ(0, pset.Add(6, 2, 7));
+  ASSERT_EQ(1u, pset.size());
+}
+
+TEST_F(DrmPropertySetTest, failed_commits_are_not_remembered) {
+  ASSERT_EQ(0, pset.Add(1, 2, 8));
+  ASSERT_NE(0, pset.Commit(-1, 0, NULL));
+  ASSERT_TRUE(pset.IsCommitted(1, 2, 3));
+  ASSERT_FALSE(pset.IsCommitted(1, 2, 8));
+}
+
+TEST_F(DrmPropertySetTest, begin_clears_the_request) {
+  ASSERT_EQ(0, pset.Add(1, 2, 8));
+  ASSERT_EQ(0, pset.Begin());
+  ASSERT_EQ(0u, pset.size());
+  pset.Committed();
+  ASSERT_TRUE(pset.IsCommitted(1, 2, 3));
+}
@@ -0,0 +1,138 @@
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "drmcrtc.h"
+#include "drmplane.h"
+#include "planearbiter.h"
+
+using android::DrmCrtc;
+using android::DrmPlane;
+using android::PlaneArbiter;
+
+static bool Contains(const std::vector<DrmPlane *> &planes, DrmPlane *plane) {
+  return std::find(planes.begin(), planes.end(), plane) != planes.end();
+}
+
+struct PlaneArbiterTest : public testing::Test {
+  static const unsigned kHysteresis = 3;
+
+  std::unique_ptr<DrmCrtc> crtcs[2];
+  // Plane 0 only works on crtc 0, planes 1 and 2 on both
+  std::unique_ptr<DrmPlane> planes[3];
+  PlaneArbiter arbiter;
+
+  virtual void SetUp() {
+    for (unsigned i = 0; i < 2; i++) {
+      drmModeCrtc crtc;
+      memset(&crtc, 0, sizeof(crtc));
+      crtc.crtc_id = 10 + i;
+      crtcs[i].reset(new DrmCrtc(NULL, &crtc, i));
+    }
+
+    uint32_t possible_crtcs[3] = {0x1, 0x3, 0x3};
+    std::vector<DrmPlane *> overlay_planes;
+    for (unsigned i = 0; i < 3; i++) {
+      drmModePlane plane;
+      memset(&plane, 0, sizeof(plane));
+      plane.plane_id = 20 + i;
+      plane.possible_crtcs = possible_crtcs[i];
+      planes[i].reset(new DrmPlane(NULL, &plane));
+      overlay_planes.push_back(planes[i].get());
+    }
+
+    arbiter.Init(overlay_planes, kHysteresis);
+    arbiter.AddDisplay(0, crtcs[0].get());
+    arbiter.AddDisplay(1, crtcs[1].get());
+  }
+
+  void Acquire(int display, uint64_t frame_no, size_t demand,
+               std::vector<DrmPlane *> *acquired,
+               std::vector<DrmPlane *> *released) {
+    acquired->clear();
+    released->clear();
+    arbiter.AcquirePlanes(display, frame_no, demand, acquired, released);
+  }
+};
+
+TEST_F(PlaneArbiterTest, dedicated_planes_stay_with_their_display) {
+  std::vector<DrmPlane *> acquired, released;
+  Acquire(0, 1, 0, &acquired, &released);
+  ASSERT_EQ(1u, acquired.size());
+  ASSERT_EQ(planes[0].get(), acquired[0]);
+  ASSERT_TRUE(released.empty());
+
+  arbiter.ReleaseAll(0);
+  Acquire(0, 2, 0, &acquired, &released);
+  ASSERT_TRUE(Contains(acquired, planes[0].get()));
+}
+
+TEST_F(PlaneArbiterTest, shared_planes_are_claimed_up_to_demand) {
+  std::vector<DrmPlane *> acquired, released;
+  Acquire(0, 1, 2, &acquired, &released);
+  ASSERT_EQ(2u, acquired.size());
+  ASSERT_TRUE(Contains(acquired, planes[0].get()));
+
+  Acquire(1, 1, 1, &acquired, &released);
+  ASSERT_EQ(1u, acquired.size());
+  ASSERT_FALSE(Contains(acquired, planes[0].get()));
+
+  // Nothing left for display 1 to grow into
+  Acquire(1, 2, 2, &acquired, &released);
+  ASSERT_EQ(1u, acquired.size());
+}
+
+TEST_F(PlaneArbiterTest, surplus_planes_are_released_after_hysteresis) {
+  std::vector<DrmPlane *> acquired, released;
+  Acquire(0, 1, 3, &acquired, &released);
+  ASSERT_EQ(3u, acquired.size());
+
+  // Display 1 is starved, display 0 only needs its dedicated plane now
+  Acquire(1, 1, 1, &acquired, &released);
+  ASSERT_TRUE(acquired.empty());
+
+  uint64_t frame_no = 2;
+  for (unsigned i = 1; i < kHysteresis; i++, frame_no++) {
+    Acquire(0, frame_no, 1, &acquired, &released);
+    ASSERT_EQ(3u, acquired.size());
+    ASSERT_TRUE(released.empty());
+  }
+
+  Acquire(0, frame_no, 1, &acquired, &released);
+  ASSERT_EQ(1u, acquired.size());
+  ASSERT_EQ(2u, released.size());
+
+  // Released planes are only free once display 0's latest frame is committed
+  arbiter.FrameCommitted(0, frame_no - 1);
+  Acquire(1, 2, 1, &acquired, &released);
+  ASSERT_TRUE(acquired.empty());
+
+  arbiter.FrameCommitted(0, frame_no);
+  Acquire(1, 3, 1, &acquired, &released);
+  ASSERT_EQ(1u, acquired.size());
+  ASSERT_FALSE(Contains(acquired, planes[0].get()));
+}
+
+TEST_F(PlaneArbiterTest, surplus_planes_are_kept_if_nobody_wants_them) {
+  std::vector<DrmPlane *> acquired, released;
+  Acquire(0, 1, 3, &acquired, &released);
+  for (uint64_t frame_no = 2; frame_no < 2 + 2 * kHysteresis; frame_no++) {
+    Acquire(0, frame_no, 1, &acquired, &released);
+    ASSERT_EQ(3u, acquired.size());
+    ASSERT_TRUE(released.empty());
+  }
+}
+
+TEST_F(PlaneArbiterTest, release_all_frees_shared_planes) {
+  std::vector<DrmPlane *> acquired, released;
+  Acquire(0, 1, 3, &acquired, &released);
+  ASSERT_EQ(3u, acquired.size());
+
+  arbiter.ReleaseAll(0);
+  Acquire(1, 1, 2, &acquired, &released);
+  ASSERT_EQ(2u, acquired.size());
+  ASSERT_TRUE(released.empty());
+}